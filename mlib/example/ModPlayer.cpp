@@ -44,7 +44,7 @@ extern"C" static void myfree( void * );
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-ModPlayer::ModPlayer( char* mod, int freq, bool fastSwitch ) {
+ModPlayer::ModPlayer( const char* mod, int freq, bool fastSwitch ) {
 	int (*func)( void *, void * );
 	long pclk = mygetPCLK();
 	
@@ -56,7 +56,7 @@ ModPlayer::ModPlayer( char* mod, int freq, bool fastSwitch ) {
 	}
 }
 
-ModPlayer::ModPlayer( char* mod, void (*cb)(int,int, void *), void *data,
+ModPlayer::ModPlayer( const char* mod, void (*cb)(int,int, void *), void *data,
 					int freq, bool fastSwitch ) {
 	int (*func)( void *, void * );
 	long pclk = mygetPCLK();
@@ -90,6 +90,42 @@ int ModPlayer::masterVolume( int vol ) {
 	::mt_masterVolume(&_mod,vol);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// Description:
+//   Sets the software gain of the music or the sound FX channels.
+//
+// Parameters:
+//   bus  - [in] BUS_MUSIC or BUS_FX
+//   gain - [in] 8.8 fixed point gain (UNITYGAIN = 256), up to 4.0
+//
+// Returns:
+//   none
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void ModPlayer::busGain( int bus, int gain ) {
+	::mt_busGain(&_mod,bus,gain);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Description:
+//   Ducks the music while sound FX play.
+//
+// Parameters:
+//   gain  - [in] 8.8 fixed point music gain while FX play
+//   ticks - [in] length of the slide down and back, 0 turns ducking off
+//
+// Returns:
+//   none
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void ModPlayer::ducking( int gain, int ticks ) {
+	::mt_ducking(&_mod,gain,ticks);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // Description:
@@ -103,14 +139,15 @@ int ModPlayer::masterVolume( int vol ) {
 //   freq - [in] desired output frequency
 //
 // Returns:
-//   0 if ok, -1 if channel number is out of bounds
+//   0 if ok, -1 if channel number is out of bounds or the frequency
+//   can not be played at the output rate
 //
 // Changes:
 //   none.
 //
 ///////////////////////////////////////////////////////////////////////////////
 
-int ModPlayer::playFX( signed char* smp, int len, int ch, int vol, int freq ) {
+int ModPlayer::playFX( const signed char* smp, int len, int ch, int vol, int freq ) {
 	struct FXinfo fx;
 
 	// Do some sanity checking..
@@ -119,7 +156,7 @@ int ModPlayer::playFX( signed char* smp, int len, int ch, int vol, int freq ) {
 	if (vol < 0) { vol = 0; }
 	if (ch >= MAX_FX_CHANNELS) { ch = MAX_FX_CHANNELS-1; }
 	if (ch < 0) { ch = 0; }
-
+	if (freq <= 0) { return -1; }
 
 	fx.channel = ch;
 	fx.instrument = 0;
@@ -217,6 +254,80 @@ void ModPlayer::setCallback( void (*cb)(int songpos, int pattpos, void *userdata
 	::mt_setCallback(cb,data,&_mod);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// Description:
+//   Selects the events the player posts into its event ring.
+//
+// Parameters:
+//   mask - [in] (1 << EV_xxx) bits or EV_ALL. 0 disables the events.
+//
+// Returns:
+//   none
+//
+// Note: unlike the callback the events are read outside the mixing
+// context with getEvent() and are stamped with the output sample.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void ModPlayer::events( int mask ) {
+	::mt_events(&_mod,mask);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Description:
+//   Gets the oldest event from the event ring.
+//
+// Parameters:
+//   e - [out] ptr to the event
+//
+// Returns:
+//   true if an event was returned, false if there are none.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+bool ModPlayer::getEvent( struct mt_event *e ) {
+	return ::mt_getEvent(&_mod,e) != 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Description:
+//   Enables/disables publishing the channel state snapshot every tick.
+//
+// Parameters:
+//   on - [in] true to publish the snapshots
+//
+// Returns:
+//   none
+//
+///////////////////////////////////////////////////////////////////////////////
+
+void ModPlayer::stateSnapshots( bool on ) {
+	::mt_stateSnapshots(&_mod,on);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Description:
+//   Copies the latest channel state (note, instrument, volume, period,
+//   position and peak level per channel) for drawing. Use this instead
+//   of reading the player structures that the mixer updates from the
+//   interrupt.
+//
+// Parameters:
+//   s - [out] ptr to the state
+//
+// Returns:
+//   0 or -1 if the snapshot could not be copied (see mt_getState())
+//
+///////////////////////////////////////////////////////////////////////////////
+
+int ModPlayer::getState( struct mt_state *s ) {
+	return ::mt_getState(&_mod,s);
+}
+
 
 
 //
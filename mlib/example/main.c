@@ -156,7 +156,8 @@ void main( void *arg ) {
     int updownA, updownB;
 	int biisi = 0;
 
-	struct module mod;
+	struct module mod[2];
+	struct module *cur = &mod[0];
 	struct soundBufParams sbuf;
 	struct FXinfo fx;
 
@@ -169,13 +170,13 @@ void main( void *arg ) {
 	// Init soundbuffer with a fast context switch..
 	// Output 16kHz rate, PCLK 66MHz..
 	// It is generally better to set a high PCLK..
-	initSoundBuffer(16000,66000000,&sbuf,myinstallirq,myremoveirq,mymalloc,myfree,mt_music,&mod);
+	initSoundBuffer(16000,66000000,&sbuf,myinstallirq,myremoveirq,mymalloc,myfree,mt_music,cur);
 
 	// Init only the mixing ring buffer - sound FX is possible but no module playback
 	//initSoundBuffer(12000,66000000,&sbuf,myinstallirq,myremoveirq,mymalloc,myfree,0,0);
 
 	// Init the module..
-	mt_init(modData0,&sbuf,&mod);
+	mt_init(modData0,&sbuf,cur);
 
 	gpb = rPBDAT;   // 0x156
 	gpe = rPEDAT;
@@ -209,7 +210,7 @@ void main( void *arg ) {
                   fx.instrument = 0;
                   fx.volume = 150; //64;
                   fx.freq.playFreq = 22050;
-                  mt_playFX(sampleData,10223,&fx,&mod);
+                  mt_playFX(sampleData,10223,&fx,cur);
                   updownA = 1;
                   continue;
 		}
@@ -221,30 +222,33 @@ void main( void *arg ) {
                   fx.instrument = 0;
                   fx.volume = 170;
                   fx.freq.period = 300;		// 113 <-> 856
-                  mt_playNote(&fx,&mod);
+                  mt_playNote(&fx,cur);
                   updownB = 1;
                   continue;
 		}
-		if ((biisi == 0) && (gpe & rKEY_SELECT) == 0)   {
-			mt_end(&mod);
-			mt_init(modData1,&sbuf,&mod);
+		// Switch the modules without stopping the sound.. crossfade
+		// over 50 ticks (1 second at 125 BPM). The other module
+		// struct can be reused once the crossfade is over.
+		if ((biisi == 0) && (gpe & rKEY_SELECT) == 0 && !mt_switching(cur))   {
+			mt_prepare(modData1,&mod[1],cur);
+			mt_switch(cur,&mod[1],50);
+			cur = &mod[1];
 			biisi = 1;
-			n = 0;
 			continue;
 		}
-		if ((biisi == 1) && (gpe & rKEY_START) == 0)   {
-			mt_end(&mod);
-			mt_init(modData0,&sbuf,&mod);
+		if ((biisi == 1) && (gpe & rKEY_START) == 0 && !mt_switching(cur))   {
+			mt_prepare(modData0,&mod[0],cur);
+			mt_switch(cur,&mod[0],50);
+			cur = &mod[0];
 			biisi = 0;
-			n = 0;
 			continue;
 		}
-		if (!(gpb & rKEY_UP))   { mt_enable(&mod); }  // left
-		if (!(gpb & rKEY_DOWN))  { mt_disable(&mod); }  // right
+		if (!(gpb & rKEY_UP))   { mt_enable(cur); }  // left
+		if (!(gpb & rKEY_DOWN))  { mt_disable(cur); }  // right
 		if (!(gpb & rKEY_LEFT))   { n = n + 1 < 31 ? n+1 : 31; }  // left
 		if (!(gpb & rKEY_RIGHT))  { n = n - 1 >= 0 ? n-1 : 0; }  // right
 		if (m!=n) {
-			mt_masterVolume(&mod,n);
+			mt_masterVolume(cur,n);
 			m = n;
 		}
 	}
@@ -0,0 +1,41 @@
+#ifndef _bake_h_included
+#define _bake_h_included
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  bake.h
+//
+// Description:
+//  This module defines baked songs. A module gets played through once
+//  and mixed into 8 bits signed mono PCM at the output frequency, up to
+//  the row the song loops back to. The baked song then plays as a single
+//  looped sound FX voice.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern"C" {
+#endif
+
+#include "player.h"
+
+//
+#define BAKE_GUARD		4	// loop start samples copied after the end
+#define BAKE_MAXTICKS	(50 * 60 * 20)	// give up looking for the loop
+#define BAKE_AUTOGAIN	0	// gain UNITYGAIN / channels, never clips
+//
+struct bakedSong {
+  const signed char *data;
+  int len;			// in samples
+  int loopStart;		// in samples, -1 if the song never looped
+  long freq;			// realFreq of the sound buffer
+};
+//
+int mt_bakeSong( const char *data, struct soundBufParams *sbuf, struct module *tmp,
+                 int gain, void *mem, int size, struct bakedSong *song );
+int mt_playBaked( const struct bakedSong *song, struct FXinfo *nfo, struct module *mod );
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,64 @@
+#ifndef _cache_h_included
+#define _cache_h_included
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  cache.h
+//
+// Description:
+//  This module defines the sample cache used for lazy instrument loading.
+//  Only the module header and the patterns are kept in memory. Sample data
+//  gets read through a user I/O callback into a fixed size memory area
+//  when the pattern look-ahead finds an instrument in the next rows. The
+//  least recently used instruments get thrown out when there is no room.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern"C" {
+#endif
+
+#include "player.h"
+
+//
+#define CACHE_SYNC		1	// load in mt_music(), the read callback must be fast
+#define CACHE_GUARD		4	// zeroed bytes after each sample (interpolation)
+//
+struct sampleCache {
+  // returns the number of bytes read or < 0 on error
+  int (*read)( void *user, long offset, void *dst, int len );
+  void *user;
+
+  signed char *mem;
+  int size;
+  int rows;			// look-ahead in rows
+  int flags;
+
+  unsigned long wanted;		// instruments found by the look-ahead
+  unsigned long resident;	// instruments in the cache
+  unsigned long clock;
+
+  long offset[31];		// sample data offset in the module file
+  int base[31];			// sample data offset in the cache
+  unsigned long used[31];	// LRU time stamps
+
+  // some statistics
+
+  int loads;
+  int evictions;
+  int misses;			// note triggered before the sample was loaded
+};
+//
+int mt_initCache( struct sampleCache *c, void *mem, int size, int rows, int flags,
+                  int (*read)( void *, long, void *, int ), void *user );
+void mt_serviceCache( struct module *mod );
+
+// used by the player..
+
+void mt_cacheLookAhead( struct module *mod );
+void mt_cacheTouch( struct module *mod, int ins );
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,76 @@
+#ifndef _events_h_included
+#define _events_h_included
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  events.h
+//
+// Description:
+//  This module defines the player event ring. The player posts events
+//  while processing ticks and mixing, and the game thread reads them with
+//  mt_getEvent() whenever it likes. The ring is lock-free with one writer
+//  (the mixing context) and one reader. Events are stamped with the output
+//  sample they happen at, counted from mt_init().
+//  The player also publishes a snapshot of the channel state once per
+//  tick for VU meters and tracker views. mt_getState() copies it under
+//  a sequence lock, so the mixing context never waits for the reader.
+//  This file gets included by player.h.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern"C" {
+#endif
+
+//
+#define MT_EVENTS		64	// ring size, must be a power of two
+
+#define EV_ROW			0	// a = song position, b = row
+#define EV_NOTE			1	// a = instrument, b = volume, period
+#define EV_SYNC			2	// a = effect (0x08 or 0x0e), b = params
+#define EV_FXDONE		3	// a FX channel finished playing
+
+#define EV_ALL			((1 << EV_ROW) | (1 << EV_NOTE) | (1 << EV_SYNC) | \
+				 (1 << EV_FXDONE))
+//
+struct mt_event {
+  unsigned long time;		// output sample
+  unsigned char type;
+  unsigned char channel;	// FX channels are MAX_MOD_CHANNELS + n
+  unsigned char a;
+  unsigned char b;
+  short period;
+};
+
+struct mt_state {
+  unsigned long time;		// output sample the state was mixed at
+  unsigned long playing;
+  short songPos;
+  short row;
+
+  struct {
+    short period;
+    short note;
+    unsigned char instrument;
+    unsigned char volume;
+    unsigned char peak;		// 0-127 peak since the previous snapshot
+    unsigned char pad;
+    int pos;			// sample position in bytes
+  } channels[MAX_SUPPORTED_CHANNELS];
+};
+
+struct module;
+
+//
+void mt_events( struct module *mod, int mask );
+int mt_getEvent( struct module *mod, struct mt_event *e );
+void mt_stateSnapshots( struct module *mod, int on );
+int mt_getState( struct module *mod, struct mt_state *s );
+void mt_publishState( struct module *mod );
+void mt_postEvent( struct module *mod, int type, int ch, int a, int b,
+                   int period, int offset );
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,49 @@
+#ifndef _fxcache_h_included
+#define _fxcache_h_included
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  fxcache.h
+//
+// Description:
+//  This module defines the sound FX cache. Frequently used sound FX can
+//  be registered once and get resampled to the output frequency of the
+//  sound buffer. They are then played with a step of exactly one output
+//  sample per sample, which the mixer does with a plain copy & scale.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern"C" {
+#endif
+
+#include "player.h"
+
+//
+#define FXCACHE_ENTRIES		32	// max registered sound FX
+#define FXCACHE_GUARD		4	// zeroed bytes after each FX (interpolation)
+//
+struct fxCache {
+  signed char *mem;
+  int size;
+  int used;			// bytes in use
+  long realFreq;		// the FX got resampled to this
+
+  int numEntries;
+  struct _fxEntries {
+    const signed char *src;	// the original sample
+    int srcLen;
+    int playFreq;
+    const signed char *data;	// resampled to realFreq
+    int len;
+  } entries[FXCACHE_ENTRIES];
+};
+//
+int mt_initFXCache( struct fxCache *c, struct soundBufParams *sbuf, void *mem, int size );
+int mt_registerFX( struct fxCache *c, const signed char *smp, int len, int playFreq );
+int mt_playCachedFX( struct fxCache *c, int fx, struct FXinfo *nfo, struct module *mod );
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,62 @@
+#ifndef _hostsound_h_included
+#define _hostsound_h_included
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  hostsound.h
+//
+// Description:
+//  This module defines the host sound buffer. It replaces sound.c in
+//  host builds and simulates the DMA ring buffer and its completion IRQ
+//  in simulated time, so the real-time behaviour of the player can be
+//  checked without the hardware.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern"C" {
+#endif
+
+#include "sound.h"
+
+//
+struct hostSim {
+  struct soundBufParams *sbuf;
+  int cpuScale;			// 8.8 fixed point target time per host time
+
+  // Injected CPU load: extra ns the mixing of the given IRQ takes, for
+  // other IRQs, bus contention etc. NULL if none.
+
+  long (*load)( void *user, int irq );
+  void *loadData;
+
+  // Receives every buffer the DMA starts playing. NULL if not needed.
+
+  void (*sink)( void *user, const char *buf, int bytes );
+  void *sinkData;
+
+  // simulated time in ns
+
+  unsigned long long now;	// last DMA completion
+  unsigned long long busyUntil;	// end of the last mixing
+  long playTime;		// length of the playing buffer
+
+  // statistics, times in simulated ns
+
+  int irqs;
+  int underruns;		// buffers not mixed before the DMA needed them
+  int late;			// mixing started after its IRQ
+  long mixLast;
+  long mixMax;
+  unsigned long long mixTotal;
+  long marginLast;		// time left before the deadline, < 0 underrun
+  long marginMin;
+};
+//
+int hostSimInit( struct hostSim *sim, struct soundBufParams *sbuf, int cpuScale );
+int hostSimRun( struct hostSim *sim, int irqs );
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -14,5 +14,9 @@
 //
 
 void mixer( struct module *mod );
+void mixFrames( struct module *mod, char *out, int len );
+void mixMusic( struct module *mod, int *acc, int len );
+void mt_convert( void *out, const void *acc, int len, int format, int channels, int gain );
+int mt_outputFormat( struct soundBufParams *sbuf, int format, int channels, int gain );
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef _patterns_h_included
+#define _patterns_h_included
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  patterns.h
+//
+// Description:
+//  This module defines the compact pattern storage. Every pattern gets
+//  stored as 64 channel masks, one per row, followed by the non-empty
+//  cells of the pattern. Identical patterns are stored only once. The
+//  player decodes the rows one row ahead while playing.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern"C" {
+#endif
+
+#include "player.h"
+
+//
+#define PACKEDHDR		(64 * sizeof(unsigned short))	// row masks
+//
+int mt_packPatterns( struct module *mod, void *mem, int size );
+const unsigned char *mt_patternRow( struct module *mod, struct rowCursor *cur,
+                                    int songPos, int patternPos, unsigned int *row );
+void mt_prefetchRow( struct module *mod );
+
+#ifdef __cplusplus
+}
+#endif
+#endif
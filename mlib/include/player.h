@@ -25,6 +25,16 @@ extern"C" {
 
 #include "sound.h"
 
+struct sampleCache;
+struct samplePool;
+struct musicRing;
+
+// Position of the next row to decode from compact patterns
+struct rowCursor {
+  int songPos;
+  int patternPos;
+  const unsigned int *cell;	// NULL if unknown
+};
 
 //
 #define MAX_MOD_CHANNELS        16
@@ -34,6 +44,21 @@ extern"C" {
 #define PRECISION     		8	//12
 #define PRECMASK		((1 << PRECISION) - 1)
 #define VOLUMESHIFT             0   // 0,1 or 2
+#define SAMPLEHEAD		4	// sample bytes played cleared like ProTracker
+
+// Amiga output filter models for mt_amigaFilter()
+
+#define AMIGA_NONE		0
+#define AMIGA_A500		1	// ~4.4kHz fixed RC filter + LED filter
+#define AMIGA_A1200		2	// LED filter only
+
+// Submix buses for mt_busGain()
+
+#define BUS_MUSIC		0	// module channels
+#define BUS_FX			1	// sound FX channels
+#define MT_BUSES		2
+
+#include "events.h"
 //
 struct module {
   struct soundBufParams *sbuf;
@@ -43,16 +68,38 @@ struct module {
   void (*userCallback)( int, int, void * );
   void *userData;
 
+  // Lazy loading - NULL if all samples are in memory
+
+  struct sampleCache *cache;
+
+  // Shared sample pool - NULL if the samples are in the module image
+
+  struct samplePool *pool;
+  int unrolledBytes;		// memory used by mt_unrollLoops()
+  int mipBytes;			// memory used by mt_buildMipmaps()
+
+  // Music pre-render ring - NULL if the music is mixed in mt_music()
+
+  struct musicRing *ring;
+
   // module info
 	
-  char *moduleData;
-  char *modName;
+  const char *moduleData;	// read-only, never written by the player
+  const char *modName;
   int songLen;
   int ciaa;
   int numPatterns;
   int patternSize;
-  unsigned long *patterns;
-  unsigned char *songPositions;
+  const unsigned int *patterns;	// 32 bits per cell
+  const unsigned char *songPositions;
+  
+  // Compact patterns, see mt_packPatterns(). NULL if not used.
+  
+  const unsigned char *packed;
+  struct rowCursor rowCursor;
+  int rowSongPos;			// row in rowBuf
+  int rowPatternPos;
+  unsigned int rowBuf[MAX_MOD_CHANNELS];
   
   char numInstruments;
   char numCh;
@@ -61,17 +108,32 @@ struct module {
   char posJumpFlag;
   char PBreakFlag;
   char enable;
+  char interpolate;	// 0 nearest sample, 1 interpolated mixing
+  char halfRate;	// 1 voices mixed at half realFreq, see mt_halfRate()
   
   int songPos;
   int PBreakPos;
   int pattDelTime;
   int pattDelTime2;
   int patternPos;
-  int filterOnOFF;
+  int row;		// row being played
+  int bpm;
+  int filterOnOFF;	// E0x: 1 = LED filter off
+  
+  // Amiga output filter emulation, see mt_amigaFilter()
+  
+  char amigaModel;
+  int filterCoef[2];	// fixed and LED filter, 0.8 fixed point
+  int filterState[3];
+#ifdef FLOATMIXER
+  float upState[3];	// upsampler history
+#else
+  int upState[3];	// upsampler history
+#endif
   
   struct _instruments {
-    char *name;
-    char *sampleStart;
+    const char *name;
+    const signed char *sampleStart;
     int sampleLen;		// in bytes
     char finetune;
     char volume;
@@ -80,23 +142,75 @@ struct module {
     int loopStart;
     int length;
     int replen;
+    const signed char *mip[2];	// half and quarter rate copies or NULL
+    signed char head[SAMPLEHEAD * 2];	// the start with SAMPLEHEAD bytes cleared
+    signed char tail[2];	// the last byte and the cleared byte after it
+    char dirtyHead;		// the image has something else in them
+    char dirtyTail;		// the next sample starts uncleared after the end
   } instruments[31];
   
   // channels & patters
   
   unsigned long playing;
+  unsigned long tickEffects;	// module channels with a tick handler bound
   
-  struct _channels {	// DO NOT CHANGE THE ORDER OF THESE MEMBERS!!!!!!!
-    int looped;     // 0
-    int loopstart;  // 4
-    short period;   // 8
-    short note;
+  // Module switching, see mt_switch()
+  
+  struct module *next;		// pending switch to this module
+  struct module *fadeOut;	// module being crossfaded out
+  int fadeTicks;
+  int fadePos;
+  int musicGain;		// module channels, 8.8 fixed point
+  int fadeDue;			// time to the next tick while faded out, in bpm units
+  char fadingOut;
+  char pending;			// a switch to this module is pending
+  
+  // Submix bus gains and music ducking, all 8.8 fixed point. The mixer
+  // folds them into the voice volumes, see mt_busGain() and mt_ducking()
+
+  int busGain[MT_BUSES];
+  int duckGain;			// music gain while FX play
+  int duckStep;			// gain change per tick, 0 = no ducking
+  int duck;			// current ducking gain
+
+  // Silence detection, see mixer()
+  
+  int silent;		// silent buffers in a row
+  int silentFill;
+  int silentBytes;
+
+  // Pull rendering, see mt_render()
 
-    int finalVolume;	// 12
-    int length;		// 16
-    char *start;	// 20
-    int pos;		// 24
-    int finalPeriod;	// 28
+  int renderLeft;	// frames left of the current tick
+  int renderFrac;	// tick length remainder in 1 / renderDen frames
+  int renderDen;
+  char renderHeld;	// a frame is waiting in renderHold
+  int renderHold[4];	// two frames of any format
+  
+  // Hot mixer state. The mixer reads nothing else per sample, so mixing
+  // touches one 32 bytes cache line per voice.
+
+  struct __attribute__ ((aligned (32))) _voices {
+    const signed char *start;
+    int pos;
+    int length;
+    int loopstart;
+    int looped;
+    int finalVolume;
+    int finalPeriod;	// 0 when the mixer stopped the voice
+    int step;		// set by the mixer
+#ifdef FLOATMIXER
+    int frac;		// low position bits below pos
+    int fracPos;	// pos the frac belongs to
+#endif
+  } voices[MAX_SUPPORTED_CHANNELS];
+
+  // Player & effect state
+
+  struct _channels {
+    void (*tickEffect)( struct module *, int );	// bound at row time
+    short period;
+    short note;
 
     unsigned char sample;			// sample number
     unsigned char effect;
@@ -125,6 +239,24 @@ struct module {
     int funkoffset;
     int reallength;
   } channels[MAX_SUPPORTED_CHANNELS];
+
+  // Event ring, see events.h
+
+  int evMask;
+  volatile unsigned short evHead;	// written by the mixing context
+  volatile unsigned short evTail;	// written by mt_getEvent()
+  unsigned short evLost;		// events dropped on a full ring
+  unsigned long frames;			// output samples mixed so far
+  struct mt_event events[MT_EVENTS];
+
+  // Channel state snapshot, see events.h
+
+  char stateEnable;
+  volatile unsigned long stateSeq;	// odd while being written
+  struct mt_state state;
+  unsigned long peakMixed;	// voices mixed since the last snapshot
+  int peakFrom[MAX_SUPPORTED_CHANNELS];	// their first mixed position
+  int peakDist[MAX_SUPPORTED_CHANNELS];	// and the samples stepped over
 };
 struct FXinfo {
   char channel;
@@ -136,14 +268,27 @@ struct FXinfo {
   } freq;
 };
 //
-int mt_init( char *data, struct soundBufParams *sbuf, struct module *mod );
+int mt_init( const char *data, struct soundBufParams *sbuf, struct module *mod );
+int mt_initLazy( const char *hdr, struct sampleCache *c, struct soundBufParams *sbuf,
+                 struct module *mod );
+int mt_headerSize( const char *data );
+int mt_prepare( const char *data, struct module *next, struct module *cur );
+int mt_switch( struct module *cur, struct module *next, int ticks );
+int mt_switching( struct module *mod );
 int mt_music( void *mod, void *magic );
 int mt_musicFastSwitch( void *m, void *magic );
+void mt_tick( struct module *mod );
+int mt_render( struct module *mod, void *out, int frames );
 void mt_end( struct module *mod );
 void mt_enable( struct module *mod );
 void mt_disable( struct module *mod );
 void mt_masterVolume( struct module *mod, int volume );
-int mt_playFX( signed char *smp, int len, struct FXinfo *nfo, struct module *mod );
+void mt_interpolation( struct module *mod, int on );
+void mt_halfRate( struct module *mod, int on );
+void mt_amigaFilter( struct module *mod, int model );
+void mt_busGain( struct module *mod, int bus, int gain );
+void mt_ducking( struct module *mod, int gain, int ticks );
+int mt_playFX( const signed char *smp, int len, struct FXinfo *nfo, struct module *mod );
 int mt_playNote( struct FXinfo *nfo, struct module *mod );
 void mt_stopFX( int ch, struct module *mod );
 void mt_setCallback( void (*cb)(int , int, void * ), void * data, struct module *m );
@@ -0,0 +1,62 @@
+#ifndef _pool_h_included
+#define _pool_h_included
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  pool.h
+//
+// Description:
+//  This module defines the shared sample pool. Samples of several
+//  modules and sound FX banks can be moved into one pool, where identical
+//  sample data is stored only once and reference counted. Samples are
+//  found by a hash of their data.
+//  Short sample loops can also be unrolled into a separate memory area,
+//  so that the mixer has to wrap the loop less often. Half and quarter
+//  rate copies of the instruments let the mixer step through less
+//  sample memory on high notes.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern"C" {
+#endif
+
+#include "player.h"
+
+//
+#define POOL_ENTRIES		128	// max different samples in a pool
+#define POOL_GUARD		4	// zeroed bytes after each sample (interpolation)
+#define UNROLL_GUARD		4	// loop start bytes after an unrolled loop
+#define MIP_LEVELS		2	// half and quarter rate
+//
+struct samplePool {
+  signed char *mem;
+  int size;
+  int used;			// bytes in use
+
+  int numEntries;
+  struct _poolEntries {
+    unsigned long hash;
+    int len;
+    int base;			// offset in mem
+    int refs;
+  } entries[POOL_ENTRIES];
+
+  // some statistics
+
+  int shared;			// references to an already pooled sample
+  int saved;			// bytes not stored thanks to sharing
+};
+//
+int mt_initPool( struct samplePool *p, void *mem, int size );
+int mt_poolSamples( struct module *mod, struct samplePool *p );
+void mt_poolRelease( struct module *mod );
+const signed char *mt_poolAdd( struct samplePool *p, const signed char *smp, int len );
+void mt_poolRemove( struct samplePool *p, const signed char *smp );
+int mt_unrollLoops( struct module *mod, void *mem, int size, int minLen );
+int mt_buildMipmaps( struct module *mod, void *mem, int size );
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,69 @@
+#ifndef _prerender_h_included
+#define _prerender_h_included
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  prerender.h
+//
+// Description:
+//  This module defines the music pre-render ring. The module music gets
+//  played and mixed ahead of time from the main loop (or a worker thread
+//  on a host) into a ring of accumulator samples. The mixing context then
+//  only mixes the sound FX on top of the rendered music.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifdef __cplusplus
+extern"C" {
+#endif
+
+#include "player.h"
+
+//
+#define RENDER_TICKS		128	// max rendered ticks, must be a power of two
+//
+struct musicRing {
+  int *mem;			// accumulator samples (floats with FLOATMIXER)
+  int size;			// in samples
+  int head;			// end of the last rendered tick
+  int maxLen;			// samples of the longest tick (bpm 32)
+
+  struct module *music;		// plays the module ahead of time
+  struct soundBufParams sbuf;	// private copy for the music module
+
+  volatile unsigned short tickHead;	// written by mt_servicePreRender()
+  volatile unsigned short tickTail;	// written by the mixing context
+  struct _renderedTicks {
+    int pos;			// in mem
+    int len;			// mixed samples
+    int outLen;			// sbuf->len for the tick
+    short bpm;
+    short songPos;
+    short patternPos;
+    short row;
+    char filterOnOFF;
+  } ticks[RENDER_TICKS];
+
+  const int *cur;		// tick being mixed, NULL if none was ready
+
+  // statistics
+
+  volatile unsigned long skew;	// frames played without rendered music
+  unsigned long skewed;		// skew already added to music->frames
+  int underruns;
+};
+//
+int mt_initPreRender( struct module *mod, struct module *music, struct musicRing *r,
+                      void *mem, int size );
+int mt_servicePreRender( struct module *mod );
+int mt_preRendered( struct module *mod );
+
+// mixing context, called by mt_music()
+
+void mt_nextRendered( struct module *mod );
+void mt_doneRendered( struct module *mod );
+
+#ifdef __cplusplus
+}
+#endif
+#endif
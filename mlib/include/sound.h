@@ -24,9 +24,24 @@ extern"C" {
 #endif
 
 
+#define SSIZE16BITS	2
+#define SSIZE8BITS	1
+
+// output formats
+
+#define SFMT_S16	0
+#define SFMT_S8		1
+#define SFMT_U8		2
+#define SFMT_F32	3
+
+#define UNITYGAIN	256	// 8.8 fixed point
+
+#define SFMT_BIT(f,ch)	(1 << ((f) * 2 + (ch) - 1))	// see formats below
+#define SFMT_ANY	0xff
+
 struct soundBufParams {
-  void *callbackData;	// Fixed position to ease up
-  int (*callback)( void *, void * );	// ASM IRQ dispatchers
+  void *callbackData;
+  int (*callback)( void *, void * );	// called by the DMA ISR
   int frame;		// 08 - 0 == lower frame of the ring buffer
 			//      1 == lower frame of the ring buffer
   char *buf[2];		// 12 - ptrs to ring buffer
@@ -42,6 +57,10 @@ struct soundBufParams {
   int tickFreq;		// 52 - e.g. 50 or 60 times per second
   int clockConstant;	// 56 - as it says..
   int bpm;
+  int format;		// SFMT_*
+  int gain;		// 8.8 fixed point software gain
+  int bufBytes;		// allocated size of one buffer in bytes
+  int formats;		// SFMT_BIT()s of the formats the hardware plays
   
   // some functions to control sound buffer
   
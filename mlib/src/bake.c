@@ -0,0 +1,204 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  bake.c
+//
+// Description:
+//  This module implements baked songs. mt_bakeSong() plays a module from
+//  the start in a scratch module struct, with a private copy of the sound
+//  buffer parameters, and mixes it tick by tick into 8 bits signed mono
+//  PCM at realFreq. The song ends on the first row that gets played for
+//  a second time outside of a pattern loop, which then is the loop point.
+//  mt_playBaked() plays the result on an FX channel, which at realFreq
+//  is a unity step and the cheapest voice the mixer has.
+//
+//  The mixer output is mono, so nothing gets lost there. The Amiga filter
+//  and half rate mixing apply to the FX voice when it is played, not when
+//  baking. The 8 bits conversion is the one of the SFMT_S8 output, by
+//  default with the headroom of all channels playing at full volume.
+//  Lazily loaded modules can not be baked.
+//
+//  This module does not depend on the libc or any other host system
+//  dependant function.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include "player.h"
+#include "mixer.h"
+#include "bake.h"
+
+#define MAX_ROWS	64
+#define MAX_ORDERS	128
+
+//
+// The sound buffer hooks of the private copy. The real sound buffer
+// must not get started or stopped by the scratch module.
+//
+
+static void mt_bakeHook( struct soundBufParams *p ) {
+}
+
+//
+// Returns non-zero while a pattern loop (E6x) is repeating rows. The
+// last repeat ends the loop when its row is played, so this gets
+// checked before the row.
+//
+
+static int mt_patternLooping( struct module *m ) {
+	int n;
+
+	for (n = 0; n < m->numCh; n++) {
+		if (m->channels[n].loopcount) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//
+// Plays the song once. Returns the length in samples and sets *need to
+// the memory needed for mixing it, or returns -1 if the song is too
+// long for a voice. With mem the song gets mixed and *loopStart is set
+// to the first time the row in *loopRow was played.
+//
+
+static int mt_bakePass( struct module *m, int gain, signed char *mem, int *need,
+                        int *loopRow, int *loopStart ) {
+	unsigned int visited[MAX_ORDERS * MAX_ROWS / 32];
+	int samples, ticks, len, pos, row, last, looping, n;
+
+	for (n = 0; n < MAX_ORDERS * MAX_ROWS / 32; n++) {
+		visited[n] = 0;
+	}
+	*need = 0;
+	*loopStart = -1;
+	last = -1;
+
+	for (samples = 0, ticks = 0; ticks < BAKE_MAXTICKS; ticks++) {
+		pos = m->songPos;
+		looping = mt_patternLooping( m );
+		mt_tick( m );
+
+		// a new row, not a pattern delay repeating the same one
+
+		if (m->count == 0 && (row = pos * MAX_ROWS + m->row) != last) {
+			if ((visited[row >> 5] & (1u << (row & 31))) && !looping) {
+				*loopRow = row;
+				break;
+			}
+			visited[row >> 5] |= 1u << (row & 31);
+
+			if (row == *loopRow && *loopStart < 0) {
+				*loopStart = samples;
+			}
+			last = row;
+		}
+		len = m->sbuf->len;
+
+		if (samples + len >= 0x7fffffff >> PRECISION) { return -1; }
+
+		// mixed in place, the bytes get written behind the ints read
+
+		n = ((samples + 3) & ~3) + len * sizeof(int);
+
+		if (mem) {
+			mixMusic( m, (int *)(mem + (n - len * sizeof(int))), len );
+			mt_convert( mem + samples, mem + (n - len * sizeof(int)), len, SFMT_S8, 1, gain );
+		}
+		if (*need < n) { *need = n; }
+		samples += len;
+	}
+	if (ticks == BAKE_MAXTICKS) {
+		*loopRow = -1;
+	}
+	n = (samples + BAKE_GUARD + 3) & ~3;
+
+	if (*need < n) { *need = n; }
+	return samples;
+}
+
+//
+// Bakes the module in data into mem, which must be 4 bytes aligned.
+// tmp is a scratch module struct used during the call only. gain is 8.8
+// fixed point like the sound buffer gain, UNITYGAIN mixes at the level
+// of SFMT_S8 output, where a few loud channels clip already. With
+// BAKE_AUTOGAIN every channel gets 1/numCh of the range, which never
+// clips. Returns the bytes used or needed with a NULL memory, or -1 if
+// the module can not be baked into size bytes.
+//
+
+int mt_bakeSong( const char *data, struct soundBufParams *sbuf, struct module *tmp,
+                 int gain, void *mem, int size, struct bakedSong *song ) {
+	struct soundBufParams sb;
+	signed char *d = (signed char *)mem;
+	int len, need, loopRow, loopStart, n;
+
+	if (data == (const char *)0) { return -1; }
+
+	for (n = 0; n < sizeof(struct soundBufParams); n++) {
+		((char *)&sb)[n] = ((const char *)sbuf)[n];
+	}
+	sb.stereo = 1;
+	sb.calcFreq = sb.clockConstant / sb.realFreq;	// set when started otherwise
+	sb.start = mt_bakeHook;
+	sb.stop = mt_bakeHook;
+
+	// the first pass only ticks the player to find the loop and the size
+
+	if (mt_init( data, &sb, tmp ) < 0) { return -1; }
+
+	if (gain == BAKE_AUTOGAIN) {
+		gain = UNITYGAIN / tmp->numCh;
+	}
+
+	loopRow = -1;
+	len = mt_bakePass( tmp, gain, (signed char *)0, &need, &loopRow, &loopStart );
+
+	if (len < 0) { return -1; }
+	if (mem == 0) { return need; }
+	if (need > size) { return -1; }
+
+	mt_init( data, &sb, tmp );
+	len = mt_bakePass( tmp, gain, d, &need, &loopRow, &loopStart );
+
+	for (n = 0; n < BAKE_GUARD; n++) {
+		d[len + n] = loopStart >= 0 && loopStart + n < len ? d[loopStart + n] : 0;
+	}
+	song->data = d;
+	song->len = len;
+	song->loopStart = loopStart;
+	song->freq = sbuf->realFreq;
+	return need;
+}
+
+//
+// Plays a baked song on an FX channel. The module of m gets disabled and
+// its channels stopped, the song replaces it. The voice gets started and
+// looped with the sound IRQ masked, so it never plays as a one-shot.
+//
+
+int mt_playBaked( const struct bakedSong *song, struct FXinfo *nfo, struct module *m ) {
+	struct soundBufParams *sb = m->sbuf;
+	int ch = MAX_MOD_CHANNELS + nfo->channel;
+	struct FXinfo n;
+	int ret;
+
+	if (ch >= MAX_SUPPORTED_CHANNELS) { return -1; }
+
+	n.channel = nfo->channel;
+	n.instrument = nfo->instrument;
+	n.volume = nfo->volume;
+	n.freq.playFreq = song->freq;
+
+	sb->enterCriticalSection( sb );
+
+	m->enable = 0;
+	m->playing &= MOD_MASK & ~(1 << ch);
+
+	if ((ret = mt_playFX( song->data, song->len, &n, m )) == 0 && song->loopStart >= 0) {
+		m->voices[ch].loopstart = song->loopStart;
+		m->voices[ch].looped = 1;
+	}
+	sb->leaveCriticalSection( sb );
+	return ret;
+}
@@ -0,0 +1,279 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  cache.c
+//
+// Description:
+//  This module implements a fixed size LRU sample cache for lazy instrument
+//  loading. The player scans the next rows of the song every time a new
+//  row gets played and marks the instruments it finds as wanted. The
+//  wanted instruments get loaded by mt_serviceCache(), which is normally
+//  called from the main loop so that no I/O takes place in the mixing
+//  context. With CACHE_SYNC the player calls it by itself.
+//
+//  The cache memory is managed first fit. A sample that is being played by
+//  any voice or is wanted by the look-ahead never gets thrown out.
+//
+//  This module does not depend on the libc or any other host system
+//  dependant function.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include "player.h"
+#include "cache.h"
+#include "patterns.h"
+
+//
+
+static int mt_cacheLen( struct module *m, int ins ) {
+	return (m->instruments[ins].sampleLen + CACHE_GUARD + 3) & ~3;
+}
+
+static void mt_cacheLock( struct module *m ) {
+	if (!(m->cache->flags & CACHE_SYNC)) {
+		m->sbuf->enterCriticalSection( m->sbuf );
+	}
+}
+
+static void mt_cacheUnlock( struct module *m ) {
+	if (!(m->cache->flags & CACHE_SYNC)) {
+		m->sbuf->leaveCriticalSection( m->sbuf );
+	}
+}
+
+//
+// Returns 1 if any playing voice is using the sample.
+//
+
+static int mt_cacheInUse( struct module *m, int ins ) {
+	const signed char *s, *e;
+	int ch;
+
+	s = m->cache->mem + m->cache->base[ins];
+	e = s + mt_cacheLen( m, ins );
+
+	for (ch = 0; ch < MAX_SUPPORTED_CHANNELS; ch++) {
+		if (!(m->playing & (1 << ch))) { continue; }
+		if (m->voices[ch].start >= s && m->voices[ch].start < e) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//
+// Throws a sample out of the cache. Must be called within the critical
+// section.
+//
+
+static void mt_cacheEvict( struct module *m, int ins ) {
+	struct sampleCache *c = m->cache;
+	const signed char *s, *e;
+	int ch;
+
+	s = c->mem + c->base[ins];
+	e = s + mt_cacheLen( m, ins );
+
+	// stopped voices may still point to the sample (note without instrument)
+	for (ch = 0; ch < MAX_SUPPORTED_CHANNELS; ch++) {
+		if (m->voices[ch].start >= s && m->voices[ch].start < e) {
+			m->voices[ch].start = 0;
+		}
+	}
+	m->instruments[ins].sampleStart = 0;
+	c->resident &= ~(1 << ins);
+	c->evictions++;
+}
+
+//
+// Finds a free area of len bytes. Tries the beginning of the cache and
+// the end of every loaded sample. Returns -1 if nothing was found.
+//
+
+static int mt_cacheAlloc( struct module *m, int len ) {
+	struct sampleCache *c = m->cache;
+	int n, i, b;
+
+	for (n = -1; n < 31; n++) {
+		if (n >= 0) {
+			if (!(c->resident & (1 << n))) { continue; }
+			b = c->base[n] + mt_cacheLen( m, n );
+		} else {
+			b = 0;
+		}
+		if (b + len > c->size) { continue; }
+
+		for (i = 0; i < 31; i++) {
+			if (!(c->resident & (1 << i))) { continue; }
+			if (b < c->base[i] + mt_cacheLen( m, i ) && c->base[i] < b + len) {
+				break;
+			}
+		}
+		if (i == 31) {
+			return b;
+		}
+	}
+	return -1;
+}
+
+//
+// Returns the least recently used sample that can be thrown out or -1.
+//
+
+static int mt_cacheVictim( struct module *m ) {
+	struct sampleCache *c = m->cache;
+	int n, v = -1;
+
+	for (n = 0; n < 31; n++) {
+		if (!(c->resident & (1 << n)) || (c->wanted & (1 << n))) {
+			continue;
+		}
+		if (v >= 0 && c->used[n] >= c->used[v]) {
+			continue;
+		}
+		if (!mt_cacheInUse( m, n )) {
+			v = n;
+		}
+	}
+	return v;
+}
+
+//
+
+int mt_initCache( struct sampleCache *c, void *mem, int size, int rows, int flags,
+                  int (*read)( void *, long, void *, int ), void *user ) {
+	int n;
+
+	for (n = 0; n < sizeof(struct sampleCache); n++) {
+		((char *)c)[n] = 0;
+	}
+	if (mem == (void *)0 || read == 0) {
+		return -1;
+	}
+	c->read  = read;
+	c->user  = user;
+	c->mem   = (signed char *)mem;
+	c->size  = size & ~3;
+	c->rows  = rows > 0 ? rows : 1;
+	c->flags = flags;
+	return 0;
+}
+
+//
+// Loads the wanted samples into the cache. Samples that do not fit even
+// after throwing out everything not in use stay wanted and get another
+// try on the next call.
+//
+
+void mt_serviceCache( struct module *m ) {
+	struct sampleCache *c = m->cache;
+	unsigned long want;
+	int ins, len, b, v;
+
+	if (c == (struct sampleCache *)0) { return; }
+
+	while ((want = c->wanted & ~c->resident)) {
+		for (ins = 0; !(want & (1 << ins)); ins++);
+
+		len = mt_cacheLen( m, ins );
+
+		if (len > c->size) {
+			mt_cacheLock( m );
+			c->wanted &= ~(1 << ins);	// never fits..
+			mt_cacheUnlock( m );
+			continue;
+		}
+		while ((b = mt_cacheAlloc( m, len )) < 0) {
+			mt_cacheLock( m );
+			if ((v = mt_cacheVictim( m )) >= 0) {
+				mt_cacheEvict( m, v );
+			}
+			mt_cacheUnlock( m );
+			if (v < 0) { return; }
+		}
+
+		// Nobody is using the free area.. no need to lock while reading
+		len = m->instruments[ins].sampleLen;
+
+		if (c->read( c->user, c->offset[ins], c->mem + b, len ) != len) {
+			mt_cacheLock( m );
+			c->wanted &= ~(1 << ins);
+			mt_cacheUnlock( m );
+			continue;
+		}
+		for (v = len; v < mt_cacheLen( m, ins ); v++) {
+			c->mem[b + v] = 0;
+		}
+
+		// the copy is private, so the start gets cleared in place
+		// instead of played from the instrument (see mt_sampleHead())
+
+		for (v = 0; v < SAMPLEHEAD && v < len; v++) {
+			c->mem[b + v] = 0;
+		}
+
+		mt_cacheLock( m );
+		c->base[ins] = b;
+		c->used[ins] = ++c->clock;
+		c->resident |= 1 << ins;
+		c->wanted &= ~(1 << ins);
+		m->instruments[ins].sampleStart = c->mem + b;
+		c->loads++;
+		mt_cacheUnlock( m );
+	}
+}
+
+//
+// Marks the instruments of the next rows wanted. Called by the player
+// every time a new row has been played. Pattern breaks and jumps are
+// not followed - the look-ahead catches up on the next rows.
+//
+
+void mt_cacheLookAhead( struct module *m ) {
+	struct sampleCache *c = m->cache;
+	struct rowCursor cur;
+	unsigned int row[MAX_MOD_CHANNELS];
+	const unsigned char *patt;
+	int sp, pp, r, n, s;
+
+	sp = m->songPos;
+	pp = m->patternPos;
+	cur.cell = (const unsigned int *)0;
+
+	for (r = 0; r < c->rows; r++) {
+		if (pp >= m->patternSize) {
+			pp = 0;
+			if (++sp >= m->songLen) { sp = 0; }
+		}
+		patt = mt_patternRow( m, &cur, sp, pp, row );
+
+		for (n = 0; n < m->numCh; n++, patt += 4) {
+			s = (patt[0] & 0xf0) | (patt[2] >> 4);
+
+			if (s == 0 || s > m->numInstruments) { continue; }
+			if (m->instruments[--s].sampleLen == 0) { continue; }
+
+			if (c->resident & (1 << s)) {
+				c->used[s] = ++c->clock;
+			} else {
+				c->wanted |= 1 << s;
+			}
+		}
+		pp += m->numCh;
+	}
+}
+
+//
+// Called by the player when a note gets triggered.
+//
+
+void mt_cacheTouch( struct module *m, int ins ) {
+	struct sampleCache *c = m->cache;
+
+	if (c->resident & (1 << ins)) {
+		c->used[ins] = ++c->clock;
+	} else if (m->instruments[ins].sampleLen > 0) {
+		c->wanted |= 1 << ins;	// too late for this note..
+		c->misses++;
+	}
+}
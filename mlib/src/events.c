@@ -0,0 +1,223 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  events.c
+//
+// Description:
+//  This module implements the player event ring. Only the mixing context
+//  writes evHead and only mt_getEvent() writes evTail, so neither side
+//  needs to lock. A full ring drops the new event and counts it in
+//  evLost. No events get posted for the types not enabled with
+//  mt_events(), which is the default.
+//
+//  The channel state snapshot uses a sequence lock. The writer makes the
+//  sequence odd while it updates the snapshot and the reader copies the
+//  snapshot until it gets a copy with the same even sequence before and
+//  after. The reader gives up spinning after a few tries and copies with
+//  the sound IRQ masked instead. A reader that interrupted the writer
+//  can not get a copy at all and gets an error.
+//
+//  This module does not depend on the libc or any other host system
+//  dependant function.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include "player.h"
+#include "events.h"
+
+//
+// The GP32 has a single ARM920T core, so only the compiler needs to be
+// kept from reordering the event and the index stores.
+//
+
+#ifdef __arm__
+#define BARRIER()	__asm__ __volatile__ ("" ::: "memory")
+#else
+#define BARRIER()	__sync_synchronize()
+#endif
+
+//
+
+void mt_events( struct module *m, int mask ) {
+	m->evMask = mask & EV_ALL;
+}
+
+//
+// Posts an event offset output samples into the buffer being mixed.
+// Called from the mixing context only.
+//
+
+void mt_postEvent( struct module *m, int type, int ch, int a, int b,
+                   int period, int offset ) {
+	struct mt_event *e;
+	int h = m->evHead;
+	int n = (h + 1) & (MT_EVENTS - 1);
+
+	if (n == m->evTail) {
+		m->evLost++;
+		return;
+	}
+	e = &m->events[h];
+	e->time    = m->frames + offset;
+	e->type    = type;
+	e->channel = ch;
+	e->a       = a;
+	e->b       = b;
+	e->period  = period;
+
+	BARRIER();
+	m->evHead = n;
+}
+
+//
+// Returns 1 and the oldest event or 0 if there are none.
+//
+
+int mt_getEvent( struct module *m, struct mt_event *e ) {
+	int t = m->evTail;
+
+	if (t == m->evHead) {
+		return 0;
+	}
+	BARRIER();
+	*e = m->events[t];
+
+	BARRIER();
+	m->evTail = (t + 1) & (MT_EVENTS - 1);
+	return 1;
+}
+
+//
+
+void mt_stateSnapshots( struct module *m, int on ) {
+	m->stateEnable = on ? 1 : 0;
+}
+
+//
+// Returns the largest sample magnitude between a and b, both within the
+// sample.
+//
+
+static int mt_scanPeak( const signed char *s, int a, int b ) {
+	int p = 0, x;
+
+	for (; a < b; a++) {
+		x = s[a] < 0 ? -s[a] : s[a];
+		if (x > p) { p = x; }
+	}
+	return p;
+}
+
+//
+// Returns the peak of the samples a voice stepped over since the last
+// snapshot, from the first mixed position on and over the loop wraps.
+// The sample after the last position is included, the interpolation
+// reads it.
+//
+
+static int mt_voicePeak( const struct _voices *v, int from, int dist ) {
+	int len = v->length, end, loop, p, q;
+
+	if (v->start == 0 || len <= 0) { return 0; }
+	if (from < 0) { from = 0; }
+	if (from > len) { from = len; }
+
+	end = from + dist + 1;
+
+	if (end <= len) {
+		return mt_scanPeak( v->start, from, end );
+	}
+	p = mt_scanPeak( v->start, from, len );
+
+	if (!v->looped || v->loopstart >= len) { return p; }
+
+	loop = len - v->loopstart;
+	end -= len;
+	q = mt_scanPeak( v->start, v->loopstart, end < loop ? v->loopstart + end : len );
+	return q > p ? q : p;
+}
+
+//
+// Publishes the channel state after a tick got mixed. Called from the
+// mixing context only. The peak is the largest sample the voice played
+// since the previous snapshot, scaled by the voice volume.
+//
+
+void mt_publishState( struct module *m ) {
+	struct mt_state *s = &m->state;
+	int n, p;
+
+	m->stateSeq++;
+	BARRIER();
+
+	s->time    = m->frames;
+	s->playing = m->playing;
+	s->songPos = m->songPos;
+	s->row     = m->row;
+
+	for (n = 0; n < MAX_SUPPORTED_CHANNELS; n++) {
+		s->channels[n].period     = m->channels[n].period;
+		s->channels[n].note       = m->channels[n].note;
+		s->channels[n].instrument = m->channels[n].sample;
+		s->channels[n].volume     = m->voices[n].finalVolume;
+		s->channels[n].pos        = m->voices[n].pos >> PRECISION;
+
+		p = 0;
+		if (m->peakMixed & (1 << n)) {
+			p = mt_voicePeak( &m->voices[n], m->peakFrom[n], m->peakDist[n] );
+			p = (p * m->voices[n].finalVolume) >> 6;
+		}
+		s->channels[n].peak = p > 127 ? 127 : p;
+	}
+	m->peakMixed = 0;
+
+	BARRIER();
+	m->stateSeq++;
+}
+
+//
+// Copies the latest channel state snapshot. Never blocks the mixing
+// context. Returns 0, or -1 if the caller interrupted the mixing context
+// while it was writing the snapshot, in which case s is not valid.
+//
+
+#define STATE_TRIES		8
+
+//
+// Returns 1 if the copy is consistent.
+//
+
+static int mt_copyState( struct module *m, struct mt_state *s ) {
+	const unsigned long *src = (const unsigned long *)&m->state;
+	unsigned long *dst = (unsigned long *)s;
+	unsigned long seq;
+	int n;
+
+	if ((seq = m->stateSeq) & 1) {
+		return 0;
+	}
+	BARRIER();
+	// no libc memcpy()..
+	for (n = 0; n < sizeof(struct mt_state) / sizeof(long); n++) {
+		dst[n] = src[n];
+	}
+	BARRIER();
+	return seq == m->stateSeq;
+}
+
+int mt_getState( struct module *m, struct mt_state *s ) {
+	int n, ok;
+
+	for (n = 0; n < STATE_TRIES; n++) {
+		if (mt_copyState( m, s )) {
+			return 0;
+		}
+	}
+
+	// the writer can not run while the sound IRQ is masked
+
+	m->sbuf->enterCriticalSection( m->sbuf );
+	ok = mt_copyState( m, s );
+	m->sbuf->leaveCriticalSection( m->sbuf );
+	return ok ? 0 : -1;
+}
@@ -0,0 +1,112 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  fxcache.c
+//
+// Description:
+//  This module implements the sound FX cache. mt_registerFX() resamples
+//  a sound FX with linear interpolation from its play frequency to the
+//  realFreq of the sound buffer and returns a handle for it. Registering
+//  the same sample at the same frequency again returns the old handle.
+//  The memory is used like a stack, entries never get freed one by one.
+//
+//  mt_playCachedFX() plays the resampled FX through mt_playFX() at
+//  realFreq. The period is then clockConstant / realFreq, which the mixer
+//  recognizes as a unity step and mixes without any position math.
+//  Register the FX after the sound buffer has been set up, otherwise the
+//  FX still play at the right pitch but lose the unity step.
+//
+//  This module does not depend on the libc or any other host system
+//  dependant function.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include "player.h"
+#include "fxcache.h"
+
+//
+
+int mt_initFXCache( struct fxCache *c, struct soundBufParams *sb, void *mem, int size ) {
+	if (mem == 0 || size < 0) { return -1; }
+
+	c->mem = (signed char *)mem;
+	c->size = size & ~3;
+	c->used = 0;
+	c->realFreq = sb->realFreq;
+	c->numEntries = 0;
+	return 0;
+}
+
+//
+// Resamples smp of len bytes played at playFreq to realFreq. Returns a
+// handle for mt_playCachedFX() or -1 if the cache is full.
+//
+
+int mt_registerFX( struct fxCache *c, const signed char *smp, int len, int playFreq ) {
+	struct _fxEntries *e;
+	signed char *d;
+	unsigned long step, frac;
+	int n, need, pos;
+
+	if (smp == 0 || len <= 0 || playFreq <= 0) { return -1; }
+
+	for (n = 0; n < c->numEntries; n++) {
+		e = &c->entries[n];
+
+		if (e->src == smp && e->srcLen == len && e->playFreq == playFreq) {
+			return n;
+		}
+	}
+	if (c->numEntries == FXCACHE_ENTRIES) { return -1; }
+
+	// 16.16 source samples per output sample and an upper bound of
+	// the output length from the step rounded down to 8.8
+
+	step = ((unsigned long)playFreq << 16) / c->realFreq;
+
+	if (step == 0 || step >= 0x01000000) { return -1; }
+
+	need = ((unsigned long)len << 8) / (step >> 8 ? step >> 8 : 1) + 1;
+
+	if (len >= 0x00800000 || c->used + need + FXCACHE_GUARD > c->size) {
+		return -1;
+	}
+	d = c->mem + c->used;
+
+	for (n = 0, pos = 0, frac = 0; n < need && pos < len; n++) {
+		int s0 = smp[pos];
+		int s1 = pos + 1 < len ? smp[pos + 1] : s0;
+
+		d[n] = s0 + (((s1 - s0) * (int)frac) >> 16);
+		frac += step;
+		pos  += frac >> 16;
+		frac &= 0xffff;
+	}
+	for (pos = 0; pos < FXCACHE_GUARD; pos++) {
+		d[n + pos] = 0;
+	}
+	e = &c->entries[c->numEntries++];
+	e->src = smp;
+	e->srcLen = len;
+	e->playFreq = playFreq;
+	e->data = d;
+	e->len = n;
+	c->used += (n + FXCACHE_GUARD + 3) & ~3;
+	return c->numEntries - 1;
+}
+
+//
+// Plays a registered FX. The frequency in nfo is not used.
+//
+
+int mt_playCachedFX( struct fxCache *c, int fx, struct FXinfo *nfo, struct module *m ) {
+	struct FXinfo n;
+
+	if (fx < 0 || fx >= c->numEntries) { return -1; }
+
+	n.channel = nfo->channel;
+	n.instrument = nfo->instrument;
+	n.volume = nfo->volume;
+	n.freq.playFreq = c->realFreq;
+	return mt_playFX( c->entries[fx].data, c->entries[fx].len, &n, m );
+}
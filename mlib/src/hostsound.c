@@ -0,0 +1,252 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  hostsound.c
+//
+// Description:
+//  This module implements the sound ring buffer of sound.h for host
+//  builds. No sound gets played, the DMA and its completion IRQ are
+//  simulated instead. hostSimRun() advances the simulated time a buffer
+//  at a time: the DMA finishes the playing buffer, the IRQ starts the
+//  other one with playnextchunk() and the callback mixes the next one.
+//
+//  The host CPU time of every callback gets measured, scaled by cpuScale
+//  to the target CPU and the injected load gets added to it. A mix that
+//  is not done when the DMA finishes the buffer playing meanwhile is an
+//  underrun. A mix that can not start at its IRQ because the previous
+//  one is still running is late, which on the target would be a nested
+//  IRQ or a lost one. The buffers get played in simulated time whether
+//  they were ready or not, the sink gets what a fast enough CPU plays.
+//
+//  This module depends on the POSIX clock_gettime() and is not a part
+//  of the target build.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include <time.h>
+#include "hostsound.h"
+
+#define TICKFREQ	50
+#define STEREOSIZE	2
+
+#define PALCLOCK	3546895
+
+static struct hostSim *g_sim;
+
+//
+// The hooks of the sound buffer. There is no other thread or IRQ on the
+// host, so the critical sections have nothing to keep out.
+//
+
+static void startSound( struct soundBufParams *p ) {
+	int n, m;
+
+	m = (p->buf[1] - p->buf[0]) * 2;
+
+	for (n = 0; n < m; n++) {
+		(p->buf[0])[n] = 0;
+	}
+	p->calcFreq = p->clockConstant / p->realFreq;
+	p->playing = 1;
+
+	// and trigger DMA..
+
+	playnextchunk( p );
+}
+
+static void stopSound( struct soundBufParams *p ) {
+	p->playing = 0;
+}
+
+static void criticalSection( struct soundBufParams *p ) {
+}
+
+static void setVolume( int vol ) {
+}
+
+//
+// The host CPU time used by this thread in ns.
+//
+
+static unsigned long long cpuTime( void ) {
+	struct timespec ts;
+
+	clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//
+// Starts the DMA on the next buffer. The simulated time of it gets
+// taken from the buffer length, as the length changes with the tempo.
+//
+
+void playnextchunk( struct soundBufParams *sbuf ) {
+	struct hostSim *s = g_sim;
+
+	if (s && s->sbuf == sbuf) {
+		s->playTime = (long)((unsigned long long)(sbuf->len / sbuf->stereo) *
+		              1000000000 / sbuf->realFreq);
+
+		if (s->sink) {
+			s->sink( s->sinkData, sbuf->buf[sbuf->frame], sbuf->len * sbuf->sampleSize );
+		}
+	}
+	sbuf->frame = (sbuf->frame + 1) & 1;
+}
+
+int calcBufferSize( struct soundBufParams *p, int numBufs, int bpm ) {
+	int len = (p->realFreq / p->tickFreq) * 125 / bpm;
+	len = len & 1 ? len + 1 : len;
+	return numBufs * p->stereo * len;
+}
+
+//
+// As in sound.c. The host plays any frequency, realFreq is playFreq and
+// pclk gets ignored.
+//
+
+int initSoundBuffer( long playFreq, long pclk, struct soundBufParams *p,
+					 void (*installIRQ)( int, void (*)(void), struct soundBufParams * ),
+					 void (*removeIRQ)( int ),
+					 void *(*allocMem)( int ),
+					 void (*freeMem)( void * ),
+					 int (*callback)( void *, void * ),
+					 void *cbdata ) {
+	char *buffer;
+	int n, len;
+
+	for (n = 0; n < sizeof(struct soundBufParams); n++) {
+		((char *)p)[n] = 0;
+	}
+	p->installIRQ = installIRQ;
+	p->removeIRQ  = removeIRQ;
+	p->allocMem   = allocMem;
+	p->freeMem    = freeMem;
+	p->callback   = callback;
+	p->callbackData = cbdata;
+	p->playFreq   = playFreq;
+	p->realFreq   = playFreq;
+	p->stereo     = STEREOSIZE;
+#ifdef S8MIXER
+	p->sampleSize = SSIZE8BITS;
+	p->format     = SFMT_S8;
+#else
+	p->sampleSize = SSIZE16BITS;
+	p->format     = SFMT_S16;
+#endif
+	p->gain       = UNITYGAIN;
+	p->formats    = SFMT_ANY;
+	p->tickFreq   = TICKFREQ;
+	p->clockConstant = PALCLOCK;
+	p->irq        = -1;
+	p->frame = 0;
+	p->bpm = 125;
+	p->pclk = pclk;
+
+	p->start  = startSound;
+	p->stop   = stopSound;
+	p->volume = setVolume;
+	p->enterCriticalSection = criticalSection;
+	p->leaveCriticalSection = criticalSection;
+
+	len = calcBufferSize( p, 1, 32 );
+	p->len = calcBufferSize( p, 1, 125 );
+
+	if ((buffer = allocMem(2 * len * SSIZE16BITS +
+		sizeof(int) * len))) {
+		p->buf[0] = buffer;
+		p->buf[1] = buffer + len * SSIZE16BITS;
+		p->tmp    = (int *)(buffer + 2 * len * SSIZE16BITS);
+		p->bufBytes = len * SSIZE16BITS;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+void releaseSoundBuffer( struct soundBufParams *p ) {
+	if (p == (void *)0) { return; }
+	if (p->playing) {
+		p->stop(p);
+		p->playing = 0;
+	}
+	if (p->buf[0]) {
+		p->freeMem(p->buf[0]);
+		p->buf[0] = (void *)0;
+	}
+}
+
+//
+// Attaches the simulator to a sound buffer, before it gets started.
+// cpuScale is 8.8 fixed point, e.g. 20 * 256 for a target CPU 20 times
+// slower than the host. The load and sink can be set afterwards.
+//
+
+int hostSimInit( struct hostSim *sim, struct soundBufParams *sbuf, int cpuScale ) {
+	int n;
+
+	if (sbuf == (void *)0 || cpuScale < 0) { return -1; }
+
+	for (n = 0; n < sizeof(struct hostSim); n++) {
+		((char *)sim)[n] = 0;
+	}
+	sim->sbuf = sbuf;
+	sim->cpuScale = cpuScale;
+	sim->marginMin = 0x7fffffff;
+	g_sim = sim;
+	return 0;
+}
+
+//
+// Runs the given number of DMA completion IRQs, or until the sound
+// buffer gets stopped. Returns the underruns so far.
+//
+
+int hostSimRun( struct hostSim *sim, int irqs ) {
+	struct soundBufParams *p = sim->sbuf;
+	unsigned long long start, deadline, t;
+	long mix;
+	int n;
+
+	for (n = 0; n < irqs && p->playing; n++) {
+
+		// the playing buffer is done and the IRQ starts the next one
+
+		sim->now += sim->playTime;
+		playnextchunk( p );
+		deadline = sim->now + sim->playTime;
+
+		start = sim->now;
+
+		if (sim->busyUntil > start) {
+			start = sim->busyUntil;
+			sim->late++;
+		}
+
+		t = cpuTime();
+
+		if (p->callback) {
+			p->callback( p->callbackData, (void *)0 );
+		}
+		t = cpuTime() - t;
+
+		mix = (long)((t * sim->cpuScale) >> 8);
+
+		if (sim->load) {
+			mix += sim->load( sim->loadData, sim->irqs );
+		}
+		sim->busyUntil = start + mix;
+		sim->irqs++;
+
+		sim->mixLast = mix;
+		sim->mixTotal += mix;
+
+		if (sim->mixMax < mix) { sim->mixMax = mix; }
+
+		sim->marginLast = (long)(deadline - sim->busyUntil);
+
+		if (sim->marginMin > sim->marginLast) { sim->marginMin = sim->marginLast; }
+		if (sim->marginLast < 0) { sim->underruns++; }
+	}
+	return sim->underruns;
+}
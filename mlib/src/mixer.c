@@ -4,12 +4,22 @@
 //  mixer.c
 //
 // Description:
-//  This module implements several example mixers.  Included mixer are:
-//   1) signed 16 bits mixer (both C and ASM versions)
-//   2) signed 8 bits mixer (both C and ASM versions)
-//  All mixers are mono, that outputs the same sample on both channels.
-//  C versions do simple interpolation between samples. To be honest these
-//  mixers are far from correct ones in terms of proper signal processing.
+//  This module implements the mixer. The inner loops are generated at
+//  compile time for every combination of:
+//   1) interpolated or nearest sample
+//   2) full volume (shift) or scaled volume (multiply)
+//  and placed into a kernel table. The kernel gets chosen per voice at
+//  runtime. The inner loops do not check for the sample end - the voice
+//  driver splits the buffer at the sample end/loop points and handles
+//  looped and one-shot samples. The output format (signed 16 or 8 bits,
+//  unsigned 8 bits or float), mono or stereo and the gain get chosen at
+//  runtime from the sound buffer. Stereo output has the same sample on
+//  both channels. The optional Amiga output filters run in the same
+//  pass as the output conversion. With mt_halfRate() the voices get mixed
+//  at half the output frequency and the mix gets upsampled on the way
+//  to the output conversion.
+//  To be honest these mixers are far from correct ones in terms of proper
+//  signal processing.
 //
 //  These mixers do not depend on the libc or any other host system
 //  dependant function.
@@ -26,520 +36,1072 @@
 
 #include "player.h"
 #include "mixer.h"
+#include "prerender.h"
 
 //
 // Defines used to select proper mixer code:
-//  ASMMIXER - selects ARM assembly version of the mixers. ASM versions have
-//             lower sound quality that C versions.
-//  S8MIXER  - selects signed 8 bits PCM output instead of signed 16 bits
-//             PCM output. 8 bits versions have lower sound quality than
-//             16 bits versions.
+//  ASMMIXER - selects ARM assembly versions of the nearest sample kernels,
+//             the step calculation and the stereo output conversions. On
+//             hosts with SSE2 vectorized conversions get used. Also makes
+//             nearest sample mixing the default (see mt_interpolation()).
+//  FLOATMIXER - host builds only. Mixes into a float accumulator with
+//             32.32 fixed point positions. The tick engine, the voice
+//             driver and the accumulator scale stay the same. With SSE2
+//             the kernels do the arithmetic four samples at a time.
+//  MIXTILE  - mixes all voices over tiles of this many samples instead
+//             of every voice over the whole buffer, so the accumulator
+//             tile stays in the data cache. 0 (default) turns tiling off.
 //
 
-#ifdef ASMMIXER
+#if defined(FLOATMIXER) && defined(ASMMIXER)
+#error "FLOATMIXER is for host builds, do not define ASMMIXER with it"
+#endif
+
+#ifdef FLOATMIXER
+typedef float mixAcc;
+typedef unsigned long long mixPos;
+#define POSBITS		32
+#else
+typedef int mixAcc;
+typedef int mixPos;
+#define POSBITS		PRECISION
+#endif
+
+typedef mixPos (*mixKernel)( mixAcc *d, int cnt, const signed char *sta,
+                             mixPos pos, mixPos dx, int vol );
+
+#define FULLVOLUME	(64 << VOLUMESHIFT)
+#define FULLSHIFT	(6 + VOLUMESHIFT)
 
 //
-// Mix first into a 32bits buffer and when done convert into a 16bits
-// output buffer..
+// Samples scaled with the volume. The accumulator scale is sample * volume
+// for all kernels. The interpolated sample is PRECISION bits larger.
 //
-// This assumes L+R stereo output..
+
+#define NEAREST(s,p)	((int)(s)[(p) >> PRECISION])
+#define INTERP(s,p)		((int)(s)[(p) >> PRECISION] * (PRECMASK + 1 - ((p) & PRECMASK)) + \
+						 (int)(s)[((p) >> PRECISION) + 1] * ((p) & PRECMASK))
+
+#define NEARESTVOL(s,p,v)		(NEAREST(s,p) * (v))
+#define NEARESTFULL(s,p,v)		(NEAREST(s,p) * FULLVOLUME)
+#define INTERPVOL(s,p,v)		((INTERP(s,p) * (v)) >> PRECISION)
+#define INTERPFULL(s,p,v)		((INTERP(s,p) * FULLVOLUME) >> PRECISION)
+
+#define MIXKERNEL(name,SAMPLE,OP)										\
+static int name( int *d, int cnt, const signed char *sta,				\
+                 int pos, int dx, int vol ) {							\
+	while (cnt-- > 0) {													\
+		*d++ OP SAMPLE(sta,pos,vol);									\
+		pos += dx;														\
+	}																	\
+	return pos;															\
+}
+
+#if defined(FLOATMIXER)
+#undef MIXKERNEL
+
 //
-// This mixer is in no means near to a corret one.. It has adequate output
-// quality but cuts corners and thus introduces aliasing etc. 
+// Float kernels. The volume scaling is the same for every volume so
+// there are no full volume versions. With SSE2 the sample fetches stay
+// scalar but the interpolation and accumulation go four at a time.
 //
-// Be careful with this routine. It expects certain structure from the
-// module structure defined in the player.h.
+
+#define FFRAC(p)		((float)((unsigned int)(p) >> 8) * (1.0f / 16777216.0f))
+#define FNEAREST(s,p)	((float)(s)[(p) >> 32])
+#define FINTERP(s,p)	((float)(s)[(p) >> 32] + ((float)(s)[((p) >> 32) + 1] - \
+						 (float)(s)[(p) >> 32]) * FFRAC(p))
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+#define VNEAREST(s,p,dx)	_mm_setr_ps( FNEAREST(s,p), FNEAREST(s,p+dx),			\
+							 FNEAREST(s,p+2*dx), FNEAREST(s,p+3*dx) )
+#define VINTERP(s,p,dx)		_mm_add_ps( VNEAREST(s,p,dx), _mm_mul_ps(				\
+							 _mm_sub_ps( VNEAREST(s+1,p,dx), VNEAREST(s,p,dx) ),	\
+							 _mm_setr_ps( FFRAC(p), FFRAC(p+dx),					\
+							              FFRAC(p+2*dx), FFRAC(p+3*dx) )))
+#define VMIX(d,x)			_mm_storeu_ps( d, _mm_add_ps( _mm_loadu_ps( d ), x ))
+#define VSTORE(d,x)			_mm_storeu_ps( d, x )
+
+#define MIXKERNEL(name,SAMPLE,VSAMPLE,OP,VOP)							\
+static mixPos name( float *d, int cnt, const signed char *sta,			\
+                    mixPos pos, mixPos dx, int vol ) {					\
+	float fv = (float)vol;												\
+	__m128 v4 = _mm_set1_ps( fv );										\
+	for (; cnt >= 4; cnt -= 4, d += 4, pos += 4 * dx) {					\
+		VOP( d, _mm_mul_ps( VSAMPLE(sta,pos,dx), v4 ));					\
+	}																	\
+	while (cnt-- > 0) {													\
+		*d++ OP SAMPLE(sta,pos) * fv;									\
+		pos += dx;														\
+	}																	\
+	return pos;															\
+}
+
+#else
+
+#define MIXKERNEL(name,SAMPLE,VSAMPLE,OP,VOP)							\
+static mixPos name( float *d, int cnt, const signed char *sta,			\
+                    mixPos pos, mixPos dx, int vol ) {					\
+	float fv = (float)vol;												\
+	while (cnt-- > 0) {													\
+		*d++ OP SAMPLE(sta,pos) * fv;									\
+		pos += dx;														\
+	}																	\
+	return pos;															\
+}
+
+#endif
+
+MIXKERNEL(mixInterpVol,FINTERP,VINTERP,+=,VMIX)
+MIXKERNEL(storeInterpVol,FINTERP,VINTERP,=,VSTORE)
+MIXKERNEL(mixNearestVol,FNEAREST,VNEAREST,+=,VMIX)
+MIXKERNEL(storeNearestVol,FNEAREST,VNEAREST,=,VSTORE)
+
+#define mixInterpFull		mixInterpVol
+#define storeInterpFull		storeInterpVol
+#define mixNearestFull		mixNearestVol
+#define storeNearestFull	storeNearestVol
+
 //
-// PS: I really couldn't be arsed to get rid of the rest of the C code
-//     in this function -- sowwy.
+// clockConstant / (period * realFreq) in 32.32 fixed point. The period
+// mt_playFX() uses for realFreq is exactly one like in the integer path.
 //
 
-#ifndef S8MIXER
+static mixPos calcStep( struct soundBufParams *sb, int period ) {
+	if (period == sb->calcFreq) { return (mixPos)1 << 32; }
+	return ((mixPos)sb->clockConstant << 32) / ((mixPos)period * sb->realFreq);
+}
 
-void mixer( struct module *m ) {
-	int len, ch;
-	short *d16; 
-	int   *d32; 
-  
-	len = m->sbuf->len;
-	d32 = m->sbuf->tmp;
-	d16 = (short *)m->sbuf->buf[m->sbuf->frame];
-
-	if (m->playing == 0) {
-		asm volatile(""
-		"	mov		r0,#0					\n"
-		"	add		r1,%[_d],%[_l],lsl #1	\n"
-		"loop%=:							\n"
-		"	str		r0,[r1,#-4]!			\n"
-		"	cmp		r1,%[_d]				\n"
-		"	bgt		loop%=					\n"
-		:
-		: [_l]"r"(len),[_d]"r"(d16)
-		: "r0","r1");
-		return;
-	}
+#else	// FLOATMIXER
+
+MIXKERNEL(mixInterpVol,INTERPVOL,+=)
+MIXKERNEL(mixInterpFull,INTERPFULL,+=)
+MIXKERNEL(storeInterpVol,INTERPVOL,=)
+MIXKERNEL(storeInterpFull,INTERPFULL,=)
+
+#ifndef ASMMIXER
+
+MIXKERNEL(mixNearestVol,NEARESTVOL,+=)
+MIXKERNEL(mixNearestFull,NEARESTFULL,+=)
+MIXKERNEL(storeNearestVol,NEARESTVOL,=)
+MIXKERNEL(storeNearestFull,NEARESTFULL,=)
+
+static int calcStep( struct soundBufParams *sb, int period ) {
+	return (sb->calcFreq << PRECISION) / period;
+}
+
+#else	// ASMMIXER
+
+//
+// These mixers are in no means near to a corret one.. They have adequate
+// output quality but cut corners and thus introduce aliasing etc.
+// cnt must be > 0.
+//
+
+#define ASMKERNEL(name,LOAD,OP)											\
+static int name( int *d, int cnt, const signed char *sta,				\
+                 int pos, int dx, int vol ) {							\
+	int t0, t1;															\
+																		\
+	asm volatile(""														\
+	"loop%=:										\n"					\
+	"	add		%[t0],%[sta],%[pos],lsr %[PREC]		\n"					\
+	"	ldrsb	%[t0],[%[t0]]			@ smp		\n"					\
+	LOAD																\
+	"	add		%[pos],%[pos],%[dx]		@ pos += dx	\n"					\
+	OP																	\
+	"	subs	%[cnt],%[cnt],#1					\n"					\
+	"	str		%[t1],[%[d]],#4						\n"					\
+	"	bgt		loop%=								\n"					\
+	: [d]"+r"(d),[cnt]"+r"(cnt),[pos]"+r"(pos),[t0]"=&r"(t0),[t1]"=&r"(t1)	\
+	: [sta]"r"(sta),[dx]"r"(dx),[vol]"r"(vol),							\
+	  [PREC]"i"(PRECISION),[FULL]"i"(FULLSHIFT)							\
+	: "cc","memory");													\
+																		\
+	return pos;															\
+}
+
+ASMKERNEL(mixNearestVol,
+	"	ldr		%[t1],[%[d]]			@ d32[n]	\n",
+	"	mla		%[t1],%[vol],%[t0],%[t1]			\n")
+ASMKERNEL(mixNearestFull,
+	"	ldr		%[t1],[%[d]]			@ d32[n]	\n",
+	"	add		%[t1],%[t1],%[t0],lsl %[FULL]		\n")
+ASMKERNEL(storeNearestVol,
+	"",
+	"	mul		%[t1],%[vol],%[t0]					\n")
+ASMKERNEL(storeNearestFull,
+	"",
+	"	mov		%[t1],%[t0],lsl %[FULL]				\n")
+
+//
+// (freq << PRECISION) / period without libgcc.
+//
+
+static int calcStep( struct soundBufParams *sb, int period ) {
+	int a = sb->calcFreq << PRECISION;
+	int b = period;
+	int dx;
 
 	asm volatile(""
-	"	mov		r0,#0					\n"
-	"	add		r1,%[_d],%[_l],lsl #2	\n"
-	"loop%=:							\n"
-	"	str		r0,[r1,#-4]!			\n"
-	"	str		r0,[r1,#-4]!			\n"
-	"	cmp		r1,%[_d]				\n"
-	"	bgt		loop%=					\n"
+	"	rsb	%[_b],%[_b],#0					\n"
+	"	cmn	%[_a],%[_b],lsl #8				\n"
+	"	mov	%[_b],%[_b],lsl #15				\n"
+	"	movlo	%[_a],%[_a],lsl #7			\n"
+	"	blo	skip%=							\n"
+
+	"	adds	%[_a],%[_b],%[_a]			\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"skip%=:								\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+	"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
+	"	sublo	%[_a],%[_a],%[_b]			\n"
+
+	"	adc	%[_a],%[_a],%[_a]				\n"
+	"	mov	%[_b],%[_a],lsr #16				\n"
+	"	bic	%[_dx],%[_a],%[_b],lsl #16		\n"
+	: [_dx]"=r"(dx),[_a]"+r"(a),[_b]"+r"(b)
 	:
-	: [_l]"r"(len),[_d]"r"(d32)
-	: "r0","r1");
-
-	for (ch = 0; ch < MAX_SUPPORTED_CHANNELS; ch++) {
-		int dx;
-
-		if (!(m->playing & (1 << ch))) { continue; }
-
-		asm volatile(""
-		"	rsb	%[_b],%[_b],#0					\n"
-		"	cmn	%[_a],%[_b],lsl #8				\n"
-		"	mov	%[_b],%[_b],lsl #15				\n"
-		"	movlo	%[_a],%[_a],lsl #7			\n"
-		"	blo	skip%=							\n"
-
-		"	adds	%[_a],%[_b],%[_a]			\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"skip%=:								\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		
-		"	adc	%[_a],%[_a],%[_a]				\n"
-		"	mov	%[_b],%[_a],lsr #16				\n"
-		"	bic	%[_dx],%[_a],%[_b],lsl #16		\n"
-		: [_dx]"=r"(dx)
-		: [_a]"r"(m->sbuf->calcFreq << PRECISION),[_b]"r"(m->channels[ch].finalPeriod)
-		);
-
-		asm volatile(""
-		"	add		r5,%[_m],#12		@ start			\n"
-		"	ldmia	r5,{r5,r6,r7,r8}					\n"
-		"	@ r5 = finalVolume							\n"
-		"	@ r6 = length								\n"
-		"	@ r7 = start								\n"
-		"	@ r8 = pos									\n"
-		"	mov		r1,%[_d]			@ r1 = d32		\n"
-		"	mov		r4,%[_l],lsr #1		@ r4 = len		\n"
-#if VOLUMESHIFT > 0
-		"	mov		r5,r5,lsl %[VOL]					\n"
+	: "cc");
+
+	return dx;
+}
+
+#endif	// ASMMIXER
+#endif	// FLOATMIXER
+
+//
+// Unity step kernels for sound FX resampled to realFreq (see fxcache.c)
+// and anything else that plays at realFreq from a whole position. At a
+// step of one the interpolated sample is the sample itself.
+//
+
+#define UNITYKERNEL(name,OP)											\
+static mixPos name( mixAcc *d, int cnt, const signed char *sta,			\
+                    mixPos pos, mixPos dx, int vol ) {					\
+	const signed char *s = sta + (int)(pos >> POSBITS);					\
+	pos += (mixPos)cnt << POSBITS;										\
+	while (cnt-- > 0) {													\
+		*d++ OP (mixAcc)(*s++ * vol);									\
+	}																	\
+	return pos;															\
+}
+
+UNITYKERNEL(mixUnity,+=)
+UNITYKERNEL(storeUnity,=)
+
+//
+// The kernel table [store][interpolate][full volume]. The store kernels
+// are used by the first voice so the accumulator never needs clearing.
+//
+
+static const mixKernel mixKernels[2][2][2] = {
+	{ { mixNearestVol,   mixNearestFull   }, { mixInterpVol,   mixInterpFull   } },
+	{ { storeNearestVol, storeNearestFull }, { storeInterpVol, storeInterpFull } }
+};
+
+static const mixKernel unityKernels[2] = { mixUnity, storeUnity };
+
+//
+// Mixes up to len samples of one voice. The buffer gets split at the
+// points where the sample ends or loops so the kernels never need to
+// check the position. Loops keep the fractional position over the wrap
+// like Paula does. Returns the number of samples mixed, which is
+// less than len if the voice stopped (finalPeriod gets cleared).
+// Only the hot voice state gets touched here.
+//
+// With FLOATMIXER the position is 32.32. The fraction bits the voice pos
+// can not hold are kept aside and dropped if the player moved the voice.
+//
+// sta is the sample or its mipmap level shift (see mt_buildMipmaps()),
+// where the positions, the step and the loop are shift times smaller.
+// With ins the first SAMPLEHEAD bytes and the last byte get played
+// from the cleared copies of the instrument, at full rate only.
+//
+
+#ifdef FLOATMIXER
+#define WHOLEPOS(v)		(((v)->pos & PRECMASK) == 0 &&					\
+						 ((v)->fracPos != (v)->pos || (v)->frac == 0))
+#define LOADPOS(v)		(((mixPos)(v)->pos << (POSBITS - PRECISION)) +	\
+						 ((v)->fracPos == (v)->pos ? (v)->frac : 0))
+#define STOREPOS(v,p)	((v)->pos = (v)->fracPos = (int)((p) >> (POSBITS - PRECISION)), \
+						 (v)->frac = (int)((p) & ((1 << (POSBITS - PRECISION)) - 1)))
+#else
+#define WHOLEPOS(v)		(((v)->pos & PRECMASK) == 0)
+#define LOADPOS(v)		((v)->pos)
+#define STOREPOS(v,p)	((v)->pos = (p))
+#endif
+
+static int mixSpan( struct _voices *v, const signed char *sta, const struct _instruments *ins,
+                    int shift, mixAcc *d, int len, mixPos dx, int vol, mixKernel k ) {
+	mixPos pos, end, l, low, hend, tbeg, base, e;
+	const signed char *s;
+	int n, done = 0;
+
+	pos = LOADPOS(v);
+	low = pos & (((mixPos)1 << shift) - 1);
+	pos = pos >> shift;
+	dx  = dx >> shift;
+	end = (mixPos)(v->length >> shift) << POSBITS;
+	hend = ins && ins->dirtyHead ? (mixPos)SAMPLEHEAD << POSBITS : 0;
+	tbeg = ins && ins->dirtyTail ? end - ((mixPos)1 << POSBITS) : end;
+
+	while (done < len) {
+		if (pos < end) {
+			s = sta;
+			e = end;
+			base = 0;
+
+			if (pos < hend) {
+				s = ins->head;
+				if (hend < e) { e = hend; }
+			} else if (pos >= tbeg) {
+				s = ins->tail;
+				base = tbeg;
+			} else {
+				e = tbeg;
+			}
+			n = (e - pos + dx - 1) / dx;
+			if (n > len - done) { n = len - done; }
+
+			pos = k( d + done, n, s, pos - base, dx, vol ) + base;
+			done += n;
+
+			if (pos < e) { break; }
+			if (pos < end) { continue; }
+		}
+		if (!v->looped) {
+			v->finalPeriod = 0;
+			break;
+		}
+		if (v->loopstart >= v->length) {
+			v->finalPeriod = 0;	// sample offset past the loop
+			break;
+		}
+
+		// keep the phase, the step may be longer than the loop
+		l = end - ((mixPos)(v->loopstart >> shift) << POSBITS);
+
+		if ((pos -= l) >= end) {
+			pos = end - l + (pos - end) % l;
+		}
+	}
+	STOREPOS(v,(pos << shift) + low);
+	return done;
+}
+
+//
+// Amiga output filters on the final accumulator. The state carries over
+// buffers and the stages that are off track their input, so the LED
+// filter can be switched at tick boundaries without clicks.
+//
+
+#ifdef FLOATMIXER
+#define COEF(x,a)		((int)((x) * (a)) >> 8)
+#else
+#define COEF(x,a)		(((x) * (a)) >> 8)
 #endif
-		"	mov		r6,r6,lsl %[PREC]					\n"
-		"loop%=:										\n"
-		"	add		r2,r7,r8,lsr %[PREC]				\n"
-		"	ldrsb	r2,[r2]				@ r2 = smp		\n"
-		"	add		r8,r8,%[_dx]		@ pos += dx		\n"
-		"	cmp		r8,r6				@				\n"
-		"	ldr		r0,[r1]				@ r0 = d32[n]	\n"
-		"	blo		skip%=				@				\n"
-		"	ldr		r3,[%[_m],#0]		@ get looped	\n"
-		"	cmp		r3,#0				@				\n"
-		"	streqh	r3,[%[_m],#8]		@ period = 0	\n"
-		"	ldrne	r3,[%[_m],#4]		@				\n"
-		"	moveq	r4,#0				@ len =0 -> break\n"
-		"	movne	r8,r3,lsl %[PREC]	@ pos = ..		\n"
-		"skip%=:										\n"
-		"	mla		r3,r5,r2,r0			@ r3 = vol*...	\n"
-		"	subs	r4,r4,#1			@				\n"
-		"	str		r3,[r1],#4			@				\n"
-		"	bgt		loop%=				@				\n"
-		"	str		r8,[%[_m],#24]		@ store pos		\n"
-		:
-		: [_dx]"r"(dx),[_d]"r"(d32),[_m]"r"(&m->channels[ch]),[_l]"r"(len),
-			[PREC]"i"(PRECISION),[VOL]"i"(VOLUMESHIFT)
-		: "r0","r1","r2","r3","r4","r5","r6","r7","r8");
-
-		if (m->channels[ch].period == 0) {
-			m->playing &= ~(1 << ch);
+
+static void amigaFilter( struct module *m, mixAcc *d, int len ) {
+	int y0 = m->filterState[0];
+	int y1 = m->filterState[1];
+	int y2 = m->filterState[2];
+	int a0 = m->filterCoef[0];
+	int a1 = m->filterCoef[1];
+	int n;
+
+	if (m->filterOnOFF == 0) {
+		if (a0) {
+			for (n = 0; n < len; n++) {
+				y0 += COEF(d[n] - y0,a0);
+				y1 += COEF(y0 - y1,a1);
+				y2 += COEF(y1 - y2,a1);
+				d[n] = y2;
+			}
+		} else {
+			for (n = 0; n < len; n++) {
+				y1 += COEF(d[n] - y1,a1);
+				y2 += COEF(y1 - y2,a1);
+				d[n] = y2;
+			}
 		}
+	} else {
+		if (a0) {
+			for (n = 0; n < len; n++) {
+				y0 += COEF(d[n] - y0,a0);
+				d[n] = y0;
+			}
+		}
+		y1 = y2 = (int)d[len - 1];
 	}
+	m->filterState[0] = y0;
+	m->filterState[1] = y1;
+	m->filterState[2] = y2;
+}
 
-	asm volatile(""
-	"	mov		r1,%[_d16]							\n"
-	"	mov		r2,%[_d32]							\n"
-	"	mvn		r4,#0								\n"
-	"loop%=:										\n"
-	"	ldr		r3,[%[_d32]],#4						\n"
-	"	cmp		r3,r4,lsr #17	@ r3 > 0x00007fff	\n"
-     "	movgt	r3,r4,lsr #17	@ r3 = 0x00007fff	\n"
-	"	cmplt	r3,r4,lsl #15	@ r3 < 0xffff8000	\n"
-	"	movlt	r3,r4,lsl #15	@ r3 = 0xffff8000	\n"
-	"	strh	r3,[%[_d16]],#2						\n"
-	"	subs	%[_l],%[_l],#2						\n"
-	"	strh	r3,[%[_d16]],#2						\n"
-	"	bgt		loop%=								\n"
-	: 
-	: [_d16]"r"(d16),[_d32]"r"(d32),[_l]"r"(len)
-	: "r1","r2","r3","r4");
+#ifndef MIXTILE
+#define MIXTILE		0
+#endif
+
+#define FUSECHUNK	64
+
+//
+// 2x upsampler for mt_halfRate(). Every input sample gets followed by the
+// midpoint to the next one from a 4 tap half-band interpolator
+// (-1 9 9 -1)/16. The history carries over buffers, the output is late by
+// three output samples.
+//
+
+#ifdef FLOATMIXER
+#define HALFBAND(a,b,c,d)	((9.0f * ((b) + (c)) - (a) - (d)) * (1.0f / 16.0f))
+#else
+#define HALFBAND(a,b,c,d)	((9 * ((b) + (c)) - (a) - (d)) >> 4)
+#endif
+
+static void upsample( struct module *m, const mixAcc *s, mixAcc *d, int len ) {
+	mixAcc x0 = m->upState[0];
+	mixAcc x1 = m->upState[1];
+	mixAcc x2 = m->upState[2];
+	mixAcc x3;
+	int n;
+
+	for (n = 0; n < len; n++) {
+		x3 = s[n];
+		*d++ = HALFBAND(x0,x1,x2,x3);
+		*d++ = x2;
+		x0 = x1;
+		x1 = x2;
+		x2 = x3;
+	}
+	m->upState[0] = x0;
+	m->upState[1] = x1;
+	m->upState[2] = x2;
 }
 
-#else	// S8MIXER
+//
+// Filters and converts len accumulator samples into the output. At half
+// rate in FUSECHUNK pieces through the upsampler.
+//
+
+static void mixOut( struct module *m, mixAcc *d, int len, char *out ) {
+	struct soundBufParams *sb = m->sbuf;
+	mixAcc up[2 * FUSECHUNK];
+	int n;
+
+	if (m->halfRate == 0) {
+		if (m->amigaModel) {
+			amigaFilter( m, d, len );
+		}
+		mt_convert( out, d, len, sb->format, sb->stereo, sb->gain );
+		return;
+	}
+	for (; len > 0; len -= n, d += n) {
+		n = len < FUSECHUNK ? len : FUSECHUNK;
+		upsample( m, d, up, n );
+
+		if (m->amigaModel) {
+			amigaFilter( m, up, 2 * n );
+		}
+		mt_convert( out, up, 2 * n, sb->format, sb->stereo, sb->gain );
+		out += 2 * n * sb->sampleSize * sb->stereo;
+	}
+}
 
 //
-// Mix first into a 32bits buffer and when done convert into a 8bits
-// output buffer..
+// Picks the mipmap level for a step. The voice must still play the
+// sample of the instrument of its channel.
 //
-// This assumes L+R stereo output..
+
+static int mipLevel( struct module *m, int ch, mixPos dx, const signed char **sta ) {
+	struct _instruments *ins;
+	int s = m->channels[ch].sample;
+
+	if (s <= 0 || s > m->numInstruments) { return 0; }
+
+	ins = &m->instruments[s - 1];
+
+	if (ins->sampleStart != m->voices[ch].start) { return 0; }
+
+	if (ins->mip[1] && dx >= (mixPos)4 << POSBITS) {
+		*sta = ins->mip[1];
+		return 2;
+	}
+	if (ins->mip[0]) {
+		*sta = ins->mip[0];
+		return 1;
+	}
+	return 0;
+}
+
 //
-// This mixer is in no means near to a corret one.. It has adequate output
-// quality but cuts corners and thus introduces aliasing etc. 
+// Returns the instrument the voice plays if some of it has to be played
+// from the cleared copies (see mt_sampleHead()), or NULL.
 //
-// Be careful with this routine. It expects certain structure from the
-// module structure defined in the player.h.
+
+static const struct _instruments *sampleCopies( struct module *m, int ch ) {
+	struct _instruments *ins;
+	int s = m->channels[ch].sample;
+
+	if (s <= 0 || s > m->numInstruments) { return 0; }
+
+	ins = &m->instruments[s - 1];
+
+	if (ins->sampleStart != m->voices[ch].start) { return 0; }
+
+	return ins->dirtyHead || ins->dirtyTail ? ins : 0;
+}
+
 //
-// PS: I really couldn't be arsed to get rid of the rest of the C code
-//     in this function -- sowwy.
+// Mixes one voice into the accumulator. With store the voice overwrites
+// the accumulator. With out the voice is the last one and the result
+// gets converted into the output in small chunks while still in cache,
+// instead of doing a separate pass over the whole buffer. base is the
+// offset of d in the mixed samples.
 //
 
-void mixer( struct module *m ) {
-	int len, ch;
-	signed char *d8; 
-	int   *d32; 
-  
-	len = m->sbuf->len;
-	d32 = m->sbuf->tmp;
-	d8 = m->sbuf->buf[m->sbuf->frame];
-
-	if (m->playing == 0) {
-		asm volatile(""
-		"	mov		r0,#0					\n"
-		"	add		r1,%[_d],%[_l],lsl #1	\n"
-		"loop%=:							\n"
-		"	str		r0,[r1,#-4]!			\n"
-		"	cmp		r1,%[_d]				\n"
-		"	bgt		loop%=					\n"
-		:
-		: [_l]"r"(len),[_d]"r"(d8)
-		: "r0","r1");
-		return;
+static void mixVoice( struct module *m, int ch, mixAcc *d, int base, int len,
+                      int store, char *out ) {
+	struct _voices *v = &m->voices[ch];
+	struct soundBufParams *sb = m->sbuf;
+	const signed char *sta = v->start;
+	const struct _instruments *ins = 0;
+	int vol, gain, n, o, done, end, shift = 0;
+	mixPos dx;
+	mixKernel k;
+
+	vol = v->finalVolume << VOLUMESHIFT;
+
+	if (ch < MAX_MOD_CHANNELS) {
+		gain = (((m->musicGain * m->busGain[BUS_MUSIC]) >> 8) * m->duck) >> 8;
+	} else {
+		gain = m->busGain[BUS_FX];
 	}
+	if (gain != UNITYGAIN) {
+		vol = (vol * gain) >> 8;
+	}
+	dx  = v->finalPeriod ? calcStep( sb, v->finalPeriod ) << m->halfRate : 0;
 
-	asm volatile(""
-	"	mov		r0,#0					\n"
-	"	add		r1,%[_d],%[_l],lsl #2	\n"
-	"loop%=:							\n"
-	"	str		r0,[r1,#-4]!			\n"
-	"	str		r0,[r1,#-4]!			\n"
-	"	cmp		r1,%[_d]				\n"
-	"	bgt		loop%=					\n"
-	:
-	: [_l]"r"(len),[_d]"r"(d32)
-	: "r0","r1");
-
-	for (ch = 0; ch < MAX_SUPPORTED_CHANNELS; ch++) {
-		int dx;
-
-		if (!(m->playing & (1 << ch))) { continue; }
-
-		asm volatile(""
-		"	rsb	%[_b],%[_b],#0					\n"
-		"	cmn	%[_a],%[_b],lsl #8				\n"
-		"	mov	%[_b],%[_b],lsl #15				\n"
-		"	movlo	%[_a],%[_a],lsl #7			\n"
-		"	blo	skip%=							\n"
-
-		"	adds	%[_a],%[_b],%[_a]			\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"skip%=:								\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		"	adcs	%[_a],%[_b],%[_a],lsl #1	\n"
-		"	sublo	%[_a],%[_a],%[_b]			\n"
-		
-		"	adc	%[_a],%[_a],%[_a]				\n"
-		"	mov	%[_b],%[_a],lsr #16				\n"
-		"	bic	%[_dx],%[_a],%[_b],lsl #16		\n"
-		: [_dx]"=r"(dx)
-		: [_a]"r"(m->sbuf->calcFreq << PRECISION),[_b]"r"(m->channels[ch].finalPeriod)
-		);
-
-		asm volatile(""
-		"	add		r5,%[_m],#12		@ start			\n"
-		"	ldmia	r5,{r5,r6,r7,r8}					\n"
-		"	@ r5 = finalVolume							\n"
-		"	@ r6 = length								\n"
-		"	@ r7 = start								\n"
-		"	@ r8 = pos									\n"
-		"	mov		r1,%[_d]			@ r1 = d32		\n"
-		"	mov		r4,%[_l],lsr #1		@ r4 = len		\n"
-		"	mov		r6,r6,lsl %[PREC]					\n"
-		"loop%=:										\n"
-		"	add		r2,r7,r8,lsr %[PREC]				\n"
-		"	ldrsb	r2,[r2]				@ r2 = smp		\n"
-		"	add		r8,r8,%[_dx]		@ pos += dx		\n"
-		"	cmp		r8,r6				@				\n"
-		"	ldr		r0,[r1]				@ r0 = d32[n]	\n"
-		"	blo		skip%=				@				\n"
-		"	ldr		r3,[%[_m],#0]		@ get looped	\n"
-		"	cmp		r3,#0				@				\n"
-		"	streqh	r3,[%[_m],#8]		@ period = 0	\n"
-		"	ldrne	r3,[%[_m],#4]		@				\n"
-		"	moveq	r4,#0				@ len =0 -> break\n"
-		"	movne	r8,r3,lsl %[PREC]	@ pos = ..		\n"
-		"skip%=:										\n"
-		"	mla		r3,r5,r2,r0			@ r3 = vol*...	\n"
-		"	subs	r4,r4,#1			@				\n"
-		"	str		r3,[r1],#4			@				\n"
-		"	bgt		loop%=				@				\n"
-		"	str		r8,[%[_m],#24]		@ store pos		\n"
-		:
-		: [_dx]"r"(dx),[_d]"r"(d32),[_m]"r"(&m->channels[ch]),[_l]"r"(len),
-			[PREC]"i"(PRECISION)
-		: "r0","r1","r2","r3","r4","r5","r6","r7","r8");
-
-		if (m->channels[ch].period == 0) {
-			m->playing &= ~(1 << ch);
+	// a period too long for the output rate never steps, stop the voice
+
+	if (dx == 0) { v->finalPeriod = 0; }
+
+	v->step = (int)(dx >> (POSBITS - PRECISION));
+	k   = mixKernels[store][m->interpolate ? 1 : 0][vol == FULLVOLUME ? 1 : 0];
+
+	if (dx == (mixPos)1 << POSBITS && WHOLEPOS(v)) {
+		k = unityKernels[store];
+	}
+	if (dx >= (mixPos)2 << POSBITS && m->mipBytes) {
+		shift = mipLevel( m, ch, dx, &sta );
+	}
+	if (shift == 0) {
+		ins = sampleCopies( m, ch );
+	}
+	if (m->stateEnable && !(m->peakMixed & (1 << ch))) {
+		m->peakMixed |= 1 << ch;
+		m->peakFrom[ch] = v->pos >> PRECISION;
+		m->peakDist[ch] = 0;
+	}
+
+	for (o = 0, end = len; o < len; o += n) {
+		n = out ? len - o < FUSECHUNK ? len - o : FUSECHUNK : len;
+		done = v->finalPeriod ? mixSpan( v, sta, ins, shift, d + o, n, dx, vol, k ) : 0;
+
+		if (done < n && end == len) {
+			end = o + done;
 		}
+
+		if (store) {
+			for (; done < n; done++) {
+				d[o + done] = 0;
+			}
+		}
+		if (out) {
+			mixOut( m, d + o, n, out + (o << m->halfRate) * sb->sampleSize * sb->stereo );
+		}
+	}
+	if (m->stateEnable) {
+		m->peakDist[ch] += (int)(((mixPos)end * dx) >> POSBITS);
 	}
+	if (v->finalPeriod == 0) {
+		m->playing &= ~(1 << ch);
+		m->channels[ch].period = 0;	// tell the player
+
+		if (ch >= MAX_MOD_CHANNELS && (m->evMask & (1 << EV_FXDONE))) {
+			mt_postEvent( m, EV_FXDONE, ch, 0, 0, 0, (base + end) << m->halfRate );
+		}
+	}
+}
+
+//
+// Accumulator to output conversions. Generated for every output format,
+// mono or L+R stereo and unity or scaled gain. The gain is 8.8 fixed
+// point. 8 bits output uses the accumulator scale >> 6. The float
+// accumulator gets rounded and F32 output is not clipped at all.
+//
+
+#define CLIP16(x)		((x) > 32767 ? 32767 : (x) < -32768 ? -32768 : (x))
+#define CLIP8(x)		((x) > 127 ? 127 : (x) < -128 ? -128 : (x))
+
+#ifdef FLOATMIXER
+#define ROUNDF(x)		((int)((x) < 0 ? (x) - 0.5f : (x) + 0.5f))
+
+#define TOS16(x)		ROUNDF(CLIP16(x))
+#define TOS8(x)			ROUNDF(CLIP8((x) * (1.0f / 64.0f)))
+#define TOU8(x)			(TOS8(x) + 128)
+#define TOF32(x)		((x) * (1.0f / 32768.0f))
+
+#define UNITY(x,g)		(x)
+#define SCALED(x,g)		((x) * (float)(g) * (1.0f / 256.0f))
+#else
+#define TOS16(x)		CLIP16(x)
+#define TOS8(x)			CLIP8((x) >> 6)
+#define TOU8(x)			(CLIP8((x) >> 6) + 128)
+#define TOF32(x)		((float)CLIP16(x) * (1.0f / 32768.0f))
+
+#define UNITY(x,g)		(x)
+#define SCALED(x,g)		(((x) * (g)) >> 8)
+#endif
+
+#define CONVERT(name,TYPE,OUT,CH,GAIN)									\
+static void name( void *out, const mixAcc *acc, int len, int gain ) {	\
+	TYPE *d = (TYPE *)out;												\
+	while (len-- > 0) {													\
+		mixAcc smp = GAIN(*acc,gain);									\
+		acc++;															\
+		*d++ = OUT(smp);												\
+		if (CH == 2) { d[0] = d[-1]; d++; }								\
+	}																	\
+}
+
+//
+// With SSE2 on the host the scalar conversions only do the tails of the
+// vector ones below.
+//
+
+#if !defined(ASMMIXER) && defined(__SSE2__)
+#define SSE2CONVERT
+#define SCALAR(name)	name##Tail
+#else
+#define SCALAR(name)	name
+#endif
+
+CONVERT(SCALAR(convS16Mono),short,TOS16,1,UNITY)
+CONVERT(SCALAR(convS16MonoGain),short,TOS16,1,SCALED)
+CONVERT(SCALAR(convS16StereoGain),short,TOS16,2,SCALED)
+CONVERT(SCALAR(convS8Mono),signed char,TOS8,1,UNITY)
+CONVERT(SCALAR(convS8MonoGain),signed char,TOS8,1,SCALED)
+CONVERT(SCALAR(convS8StereoGain),signed char,TOS8,2,SCALED)
+CONVERT(SCALAR(convU8Mono),unsigned char,TOU8,1,UNITY)
+CONVERT(SCALAR(convU8Stereo),unsigned char,TOU8,2,UNITY)
+CONVERT(SCALAR(convU8MonoGain),unsigned char,TOU8,1,SCALED)
+CONVERT(SCALAR(convU8StereoGain),unsigned char,TOU8,2,SCALED)
+CONVERT(SCALAR(convF32Mono),float,TOF32,1,UNITY)
+CONVERT(SCALAR(convF32Stereo),float,TOF32,2,UNITY)
+CONVERT(SCALAR(convF32MonoGain),float,TOF32,1,SCALED)
+CONVERT(SCALAR(convF32StereoGain),float,TOF32,2,SCALED)
+
+#if defined(ASMMIXER)
+
+static void convS16Stereo( void *out, const mixAcc *acc, int len, int gain ) {
+	int t0, t1;
+
+	asm volatile(""
+	"	mvn		%[t1],#0							\n"
+	"loop%=:										\n"
+	"	ldr		%[t0],[%[d32]],#4					\n"
+	"	cmp		%[t0],%[t1],lsr #17	@ > 0x00007fff	\n"
+	"	movgt	%[t0],%[t1],lsr #17	@ = 0x00007fff	\n"
+	"	cmplt	%[t0],%[t1],lsl #15	@ < 0xffff8000	\n"
+	"	movlt	%[t0],%[t1],lsl #15	@ = 0xffff8000	\n"
+	"	strh	%[t0],[%[d16]],#2					\n"
+	"	subs	%[len],%[len],#1					\n"
+	"	strh	%[t0],[%[d16]],#2					\n"
+	"	bgt		loop%=								\n"
+	: [d16]"+r"(out),[d32]"+r"(acc),[len]"+r"(len),[t0]"=&r"(t0),[t1]"=&r"(t1)
+	:
+	: "cc","memory");
+}
+
+static void convS8Stereo( void *out, const mixAcc *acc, int len, int gain ) {
+	int t0, t1;
 
 	asm volatile(""
-	"	mov		r1,%[_d8]							\n"
-	"	mov		r2,%[_d32]							\n"
-	"	mvn		r4,#0								\n"
+	"	mvn		%[t1],#0							\n"
 	"loop%=:										\n"
-	"	ldr		r3,[%[_d32]],#4						\n"
-	"	mov		r3,r3,asr #6						\n"
-	"	cmp		r3,r4,lsr #25	@ r3 > 0x0000007f	\n"
-    "	movgt	r3,r4,lsr #25	@ r3 = 0x0000007f	\n"
-	"	cmplt	r3,r4,lsl #7	@ r3 < 0xffffff80	\n"
-	"	movlt	r3,r4,lsl #7	@ r3 = 0xffffff80	\n"
-	"	strb	r3,[%[_d8]],#1						\n"
-	"	subs	%[_l],%[_l],#2						\n"
-	"	strb	r3,[%[_d8]],#1						\n"
+	"	ldr		%[t0],[%[d32]],#4					\n"
+	"	mov		%[t0],%[t0],asr #6					\n"
+	"	cmp		%[t0],%[t1],lsr #25	@ > 0x0000007f	\n"
+	"	movgt	%[t0],%[t1],lsr #25	@ = 0x0000007f	\n"
+	"	cmplt	%[t0],%[t1],lsl #7	@ < 0xffffff80	\n"
+	"	movlt	%[t0],%[t1],lsl #7	@ = 0xffffff80	\n"
+	"	strb	%[t0],[%[d8]],#1					\n"
+	"	subs	%[len],%[len],#1					\n"
+	"	strb	%[t0],[%[d8]],#1					\n"
 	"	bgt		loop%=								\n"
-	: 
-	: [_d8]"r"(d8),[_d32]"r"(d32),[_l]"r"(len)
-	: "r1","r2","r3","r4");
+	: [d8]"+r"(out),[d32]"+r"(acc),[len]"+r"(len),[t0]"=&r"(t0),[t1]"=&r"(t1)
+	:
+	: "cc","memory");
 }
 
-#endif	// S8MIXER
+#else
 
+CONVERT(SCALAR(convS16Stereo),short,TOS16,2,UNITY)
+CONVERT(SCALAR(convS8Stereo),signed char,TOS8,2,UNITY)
 
-//////////////////////////////////////////////////////////////////////////////
-#else	// ASMMIXER
-//////////////////////////////////////////////////////////////////////////////
+#endif
+
+#ifdef SSE2CONVERT
 
 //
+// Host versions, 8 samples (F32 4) at a time. packs does the 16 and 8
+// bits saturation for free and U8 is S8 with the sign bit flipped. The
+// gain and the rounding of the float accumulator are done in the same
+// order as the scalar macros, so both agree on every sample.
 //
+
+#include <emmintrin.h>
+
+#ifdef FLOATMIXER
+#define ROUNDPS(x)		_mm_cvttps_epi32( _mm_add_ps( x, _mm_or_ps( _mm_set1_ps( 0.5f ),	\
+						 _mm_and_ps( x, _mm_set1_ps( -0.0f )))))
+#define CLIPPS(x,lo,hi)	_mm_min_ps( _mm_max_ps( x, _mm_set1_ps( lo )), _mm_set1_ps( hi ))
+
+#define VLOAD(p,g,s)	((s) ? _mm_mul_ps( _mm_mul_ps( _mm_loadu_ps( p ), _mm_set1_ps( (float)(g) )),	\
+						 _mm_set1_ps( 1.0f / 256.0f )) : _mm_loadu_ps( p ))
+#define VS16(p,g,s)		ROUNDPS( CLIPPS( VLOAD(p,g,s), -32768.0f, 32767.0f ))
+#define VS8(p,g,s)		ROUNDPS( CLIPPS( _mm_mul_ps( VLOAD(p,g,s), _mm_set1_ps( 1.0f / 64.0f )),	\
+						 -128.0f, 127.0f ))
+#define VF32(p,g,s)		_mm_mul_ps( VLOAD(p,g,s), _mm_set1_ps( 1.0f / 32768.0f ))
+#else
+
 //
-// This mixer does some simple interpolation on samples while
-// mixing and assumes L+R stereo output..
+// SSE2 has no 32 bits multiply keeping the low halves..
 //
-// This mixer is in no means near to a corret one.. It has an adequate output
-// quality and has a lame attempt of embedding kind of a low-pass filter to
-// better the sound quality and reduce aliasing. However, the multirate
-// mixing has not been implemented corretly. Thus it is somekind of half way
-// thing skipping proper sample interpolation + low-pass filter + decimation
-// with non integer stepping sample interpolation etc bla blaa bla.
+
+static __m128i mullo32( __m128i a, __m128i b ) {
+	__m128i lo = _mm_mul_epu32( a, b );
+	__m128i hi = _mm_mul_epu32( _mm_srli_epi64( a, 32 ), _mm_srli_epi64( b, 32 ));
+	return _mm_unpacklo_epi32( _mm_shuffle_epi32( lo, _MM_SHUFFLE(0,0,2,0) ),
+	                           _mm_shuffle_epi32( hi, _MM_SHUFFLE(0,0,2,0) ));
+}
+
+static __m128 vclip16f( __m128i x ) {
+	x = _mm_packs_epi32( x, x );
+	x = _mm_srai_epi32( _mm_unpacklo_epi16( x, x ), 16 );
+	return _mm_cvtepi32_ps( x );
+}
+
+#define VLOAD(p,g,s)	((s) ? _mm_srai_epi32( mullo32( _mm_loadu_si128( (const __m128i *)(p) ),	\
+						 _mm_set1_epi32( g )), 8 ) : _mm_loadu_si128( (const __m128i *)(p) ))
+#define VS16(p,g,s)		VLOAD(p,g,s)
+#define VS8(p,g,s)		_mm_srai_epi32( VLOAD(p,g,s), 6 )
+#define VF32(p,g,s)		_mm_mul_ps( vclip16f( VLOAD(p,g,s) ), _mm_set1_ps( 1.0f / 32768.0f ))
+#endif
+
+#define STS16(d,acc,g,s,CH) {												\
+	__m128i a = _mm_packs_epi32( VS16(acc,g,s), VS16(acc + 4,g,s) );		\
+	if (CH == 2) {															\
+		_mm_storeu_si128( (__m128i *)d, _mm_unpacklo_epi16( a, a ));		\
+		_mm_storeu_si128( (__m128i *)(d + 8), _mm_unpackhi_epi16( a, a ));	\
+	} else {																\
+		_mm_storeu_si128( (__m128i *)d, a );								\
+	}																		\
+}
+#define ST8(d,acc,g,s,CH,SIGN) {											\
+	__m128i a = _mm_packs_epi32( VS8(acc,g,s), VS8(acc + 4,g,s) );			\
+	a = _mm_xor_si128( _mm_packs_epi16( a, a ), _mm_set1_epi8( SIGN ));	\
+	if (CH == 2) {															\
+		_mm_storeu_si128( (__m128i *)d, _mm_unpacklo_epi8( a, a ));		\
+	} else {																\
+		_mm_storel_epi64( (__m128i *)d, a );								\
+	}																		\
+}
+#define STS8(d,acc,g,s,CH)	ST8(d,acc,g,s,CH,0)
+#define STU8(d,acc,g,s,CH)	ST8(d,acc,g,s,CH,(char)0x80)
+#define STF32(d,acc,g,s,CH) {												\
+	__m128 f = VF32(acc,g,s);												\
+	if (CH == 2) {															\
+		_mm_storeu_ps( d, _mm_unpacklo_ps( f, f ));							\
+		_mm_storeu_ps( d + 4, _mm_unpackhi_ps( f, f ));						\
+	} else {																\
+		_mm_storeu_ps( d, f );												\
+	}																		\
+}
+
+#define VCONVERT(name,TYPE,STEP,STORE,CH,SCALE)								\
+static void name( void *out, const mixAcc *acc, int len, int gain ) {		\
+	TYPE *d = (TYPE *)out;													\
+	for (; len >= STEP; len -= STEP, acc += STEP, d += STEP * CH) {			\
+		STORE(d,acc,gain,SCALE,CH)											\
+	}																		\
+	name##Tail( d, acc, len, gain );										\
+}
+
+VCONVERT(convS16Mono,short,8,STS16,1,0)
+VCONVERT(convS16MonoGain,short,8,STS16,1,1)
+VCONVERT(convS16Stereo,short,8,STS16,2,0)
+VCONVERT(convS16StereoGain,short,8,STS16,2,1)
+VCONVERT(convS8Mono,signed char,8,STS8,1,0)
+VCONVERT(convS8MonoGain,signed char,8,STS8,1,1)
+VCONVERT(convS8Stereo,signed char,8,STS8,2,0)
+VCONVERT(convS8StereoGain,signed char,8,STS8,2,1)
+VCONVERT(convU8Mono,unsigned char,8,STU8,1,0)
+VCONVERT(convU8MonoGain,unsigned char,8,STU8,1,1)
+VCONVERT(convU8Stereo,unsigned char,8,STU8,2,0)
+VCONVERT(convU8StereoGain,unsigned char,8,STU8,2,1)
+VCONVERT(convF32Mono,float,4,STF32,1,0)
+VCONVERT(convF32MonoGain,float,4,STF32,1,1)
+VCONVERT(convF32Stereo,float,4,STF32,2,0)
+VCONVERT(convF32StereoGain,float,4,STF32,2,1)
+
+#endif
+
+//
+// The conversion table [format][stereo][scaled gain]
 //
 
-#ifndef S8MIXER
+typedef void (*convertFunc)( void *out, const mixAcc *acc, int len, int gain );
 
-void mixer( struct module *m ) {
-	int pos, len, ch;
-	short *d16; 
-	int *d32;
-	int n;
+static const convertFunc convertFuncs[4][2][2] = {
+	{ { convS16Mono, convS16MonoGain }, { convS16Stereo, convS16StereoGain } },
+	{ { convS8Mono,  convS8MonoGain  }, { convS8Stereo,  convS8StereoGain  } },
+	{ { convU8Mono,  convU8MonoGain  }, { convU8Stereo,  convU8StereoGain  } },
+	{ { convF32Mono, convF32MonoGain }, { convF32Stereo, convF32StereoGain } }
+};
 
-	len = m->sbuf->len >> 1;
-	d16 = (short *)m->sbuf->buf[m->sbuf->frame];
-	d32 = m->sbuf->tmp;
+static const char formatSize[4] = { 2, 1, 1, 4 };
 
-	if (m->playing == 0) {
-		for (n = 0; n < len; n++) {
-			*d16++ = 0;
-			*d16++ = 0;
-		}
-		return;
-	} else {
-		for (n = 0; n < len; n++) {
-			d32[n] = 0;
-		}
+//
+// Converts len accumulator samples into the given format. This can be
+// used to feed several sinks with different formats from sbuf->tmp,
+// which holds floats with FLOATMIXER.
+//
+
+void mt_convert( void *out, const void *acc, int len, int format, int channels, int gain ) {
+	if (len > 0) {
+		convertFuncs[format & 3][channels == 2][gain != UNITYGAIN]( out, acc, len, gain );
 	}
+}
 
-	for (ch = 0; ch < MAX_SUPPORTED_CHANNELS; ch++) {
-		int dx, vol, end;
-		signed char *sta;
-    
-		if (!(m->playing & (1 << ch))) { continue; }
- 
-		pos = m->channels[ch].pos;
-		vol = m->channels[ch].finalVolume << VOLUMESHIFT;
-		sta = m->channels[ch].start;
-		end = m->channels[ch].length << PRECISION;
-		dx = (m->sbuf->calcFreq << PRECISION) / m->channels[ch].finalPeriod;
-    
-		for (n = 0; n < len; n++) {
-			int smp, f, x;
-
-			x = pos >> PRECISION;
-			f = pos & PRECMASK;
-			smp = 	((((int)sta[x] * (PRECMASK + 1 - f)) + 
-					((int)sta[x+1] * f)) * vol) >> PRECISION;
-					//((int)sta[x+1] * f)) >> PRECISION) * vol;
-
-			pos += dx;
-			d32[n] += smp;
-      
-			if (pos >= end) {
-				if (!m->channels[ch].looped) {
-					m->channels[ch].period = 0;
-					break;
-				} else {
-					pos = m->channels[ch].loopstart << PRECISION;
-				}
+//
+// Selects the output format of the sound buffer. Returns -1 if the
+// hardware does not play the format or it does not fit into the
+// allocated buffers. Before the sound buffer gets started (mt_init())
+// the buffers get allocated again to the size the format needs.
+//
+
+int mt_outputFormat( struct soundBufParams *p, int format, int channels, int gain ) {
+	int stereo = p->stereo;
+	int len, bytes;
+	char *buffer;
+
+	if (format < SFMT_S16 || format > SFMT_F32) { return -1; }
+	if (channels < 1 || channels > 2) { return -1; }
+	if ((p->formats & SFMT_BIT(format, channels)) == 0) { return -1; }
+
+	p->stereo = channels;
+	len = calcBufferSize( p, 1, 32 );
+	bytes = len * formatSize[format];
+
+	if (!p->playing && p->allocMem && bytes != p->bufBytes) {
+		if ((buffer = p->allocMem( 2 * bytes + sizeof(int) * len ))) {
+			if (p->buf[0]) {
+				p->freeMem( p->buf[0] );
 			}
+			p->buf[0] = buffer;
+			p->buf[1] = buffer + bytes;
+			p->tmp    = (int *)(buffer + 2 * bytes);
+			p->bufBytes = bytes;
 		}
-		if (m->channels[ch].period == 0) {
-			m->playing &= ~(1 << ch);
-		}
-		m->channels[ch].pos = pos;
 	}
-  
-	for (n = 0; n < len; n++) {
-		int smp = *d32++;
-		if (smp >= 32768) {
-			smp = 32767;
-		} else if (smp < -32768) {
-			smp = -32768;
-		}
-		*d16++ = smp;
-		*d16++ = smp;
-	}  
+	if (bytes > p->bufBytes) {
+		p->stereo = stereo;
+		return -1;
+	}
+	p->format = format;
+	p->sampleSize = formatSize[format];
+	p->gain = gain < 0 ? 0 : gain;
+	p->len = calcBufferSize( p, 1, p->bpm );
+	return 0;
 }
 
-#else  // S8MIXER
+//
+// Outputs silence. After two silent buffers in a row both ring buffers
+// are already filled with silence of the same format and length, so
+// nothing needs to be written until something plays again.
+//
 
-void mixer( struct module *m ) {
-	int pos, len, ch;
-	signed char *d8; 
-	int *d32;
+static void mixSilence( struct module *m, char *out ) {
+	int bytes = m->sbuf->len * m->sbuf->sampleSize;
+	int z = m->sbuf->format == SFMT_U8 ? 0x80808080 : 0;
+	int *o = (int *)out;
 	int n;
 
-	len = m->sbuf->len >> 1;
-	d8 = (signed char *)m->sbuf->buf[m->sbuf->frame];
-	d32 = m->sbuf->tmp;
+	if (m->silent && (m->silentFill != z || m->silentBytes != bytes)) {
+		m->silent = 0;
+	}
+	if (m->silent >= 2) {
+		return;
+	}
+	for (n = 0; n < bytes >> 2; n++) {
+		o[n] = z;
+	}
+	for (n = bytes & ~3; n < bytes; n++) {
+		out[n] = (char)z;
+	}
+	for (n = 0; n < 3; n++) {
+		m->filterState[n] = 0;
+		m->upState[n] = 0;
+	}
+	m->silentFill = z;
+	m->silentBytes = bytes;
+	m->silent++;
+}
+
+//
+// Mixes the voices over len samples at base. The first voice stores into
+// the 32bits accumulator, the rest add into it and the last one converts
+// into the output buffer as it goes. During a crossfade the module
+// channels of the module being faded out get mixed first, the output
+// state belongs to m though. Pre-rendered music takes the place of the
+// first voice. A tile after all voices stopped gets converted from
+// silence.
+//
+
+static void mixTile( struct module *m, mixAcc *d, int base, int len, char *out,
+                     const mixAcc *music ) {
+	struct module *o = m->fadeOut;
+	unsigned long playing, fading;
+	int ch, n, gain;
+
+	playing = m->playing;
+	fading = o ? o->playing & ~MOD_MASK : 0;
+
+	if (music) {
+		gain = (m->busGain[BUS_MUSIC] * m->duck) >> 8;
 
-	if (m->playing == 0) {
 		for (n = 0; n < len; n++) {
-			*d8++ = 0;
-			*d8++ = 0;
+			d[n] = gain == UNITYGAIN ? music[n] : SCALED(music[n],gain);
 		}
-		return;
-	} else {
-		for (n = 0; n < len; n++) {
-			d32[n] = 0;
+		if (playing == 0) {
+			mixOut( m, d, len, out );
+			return;
 		}
-	}
-
-	for (ch = 0; ch < MAX_SUPPORTED_CHANNELS; ch++) {
-		int dx, vol, end;
-		signed char *sta;
-    
-		if (!(m->playing & (1 << ch))) { continue; }
- 
-		pos = m->channels[ch].pos;
-		vol = m->channels[ch].finalVolume << VOLUMESHIFT;
-		sta = m->channels[ch].start;
-		end = m->channels[ch].length << PRECISION;
-		dx = (m->sbuf->calcFreq << PRECISION) / m->channels[ch].finalPeriod;
-    
+	} else if (playing == 0 && fading == 0) {
 		for (n = 0; n < len; n++) {
-			int smp, f, x;
-
-			x = pos >> PRECISION;
-			f = pos & PRECMASK;
-			smp = 	((((int)sta[x] * (PRECMASK + 1 - f)) + 
-					((int)sta[x+1] * f)) * vol) >> (PRECISION+6);
-
-			pos += dx;
-			d32[n] += smp;
-      
-			if (pos >= end) {
-				if (!m->channels[ch].looped) {
-					m->channels[ch].period = 0;
-					break;
-				} else {
-					pos = m->channels[ch].loopstart << PRECISION;
-				}
-			}
+			d[n] = 0;
 		}
-		if (m->channels[ch].period == 0) {
-			m->playing &= ~(1 << ch);
+		mixOut( m, d, len, out );
+		return;
+	}
+	for (ch = 0, n = music == 0; fading; ch++) {
+		if (fading & (1 << ch)) {
+			fading &= ~(1 << ch);
+			mixVoice( o, ch, d, base, len, n, (char *)0 );
+			n = 0;
 		}
-		m->channels[ch].pos = pos;
 	}
-  
-	for (n = 0; n < len; n++) {
-		int smp = *d32++;
-		if (smp >= 128) {
-			smp = 127;
-		} else if (smp < -128) {
-			smp = -128;
+	if (playing == 0) {
+		mixOut( m, d, len, out );
+		return;
+	}
+	for (ch = 0; playing; ch++) {
+		if (playing & (1 << ch)) {
+			playing &= ~(1 << ch);
+			mixVoice( m, ch, d, base, len, n, playing ? (char *)0 : out );
+			n = 0;
 		}
-		*d8++ = smp;
-		*d8++ = smp;
-	}  
+	}
 }
 
-#endif  // S8MIXER
-#endif  // ASMMIXER
+//
+// Mixes len output frames into out. Without MIXTILE the whole buffer is
+// one tile. The tiles use the start of the accumulator only. At half
+// rate there are half as many samples to mix and len must be even.
+//
+
+void mixFrames( struct module *m, char *out, int len ) {
+	const mixAcc *music = m->ring ? (const mixAcc *)m->ring->cur : 0;
+	int t, n, size;
+	mixAcc *d32;
 
+	len >>= m->halfRate;
+	d32 = (mixAcc *)m->sbuf->tmp;
+	size = m->sbuf->sampleSize * m->sbuf->stereo;
+	m->silent = 0;
+
+	for (t = 0; t < len; t += n) {
+		n = MIXTILE > 0 && len - t > MIXTILE ? MIXTILE : len - t;
+		mixTile( m, d32, t, n, out + (t << m->halfRate) * size, music ? music + t : 0 );
+	}
+}
+
+//
+// Mixes the sound buffer being filled.
+//
+
+void mixer( struct module *m ) {
+	struct module *o = m->fadeOut;
+	char *out = m->sbuf->buf[m->sbuf->frame];
+
+	if (m->playing == 0 && (m->ring == 0 || m->ring->cur == 0) &&
+	    (o == 0 || (o->playing & ~MOD_MASK) == 0)) {
+		mixSilence( m, out );
+		return;
+	}
+	mixFrames( m, out, m->sbuf->len / m->sbuf->stereo );
+}
+
+//
+// Mixes the module channels into acc for mt_servicePreRender(). Nothing
+// gets converted, the output state stays with the module playing FX.
+//
+
+void mixMusic( struct module *m, int *acc, int len ) {
+	unsigned long playing = m->playing & ~MOD_MASK;
+	mixAcc *d = (mixAcc *)acc;
+	int ch, n;
+
+	if (playing == 0) {
+		for (n = 0; n < len; n++) {
+			d[n] = 0;
+		}
+		return;
+	}
+	for (ch = 0, n = 1; playing; ch++) {
+		if (playing & (1 << ch)) {
+			playing &= ~(1 << ch);
+			mixVoice( m, ch, d, 0, len, n, (char *)0 );
+			n = 0;
+		}
+	}
+}
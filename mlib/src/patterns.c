@@ -0,0 +1,158 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  patterns.c
+//
+// Description:
+//  This module implements the compact pattern storage. The packed memory
+//  starts with an offset for every pattern, followed by the packed
+//  patterns:
+//
+//    unsigned int   offset[numPatterns];	// from the start of the memory
+//    unsigned short mask[64];			// bit n set if channel n has a cell
+//    unsigned int   cell[];			// non-empty cells as in the module
+//
+//  Identical patterns share the same packed pattern. The player keeps a
+//  cursor at the next row, so decoding a row in play order is just
+//  copying its cells. Other rows get found by counting the cells of the
+//  rows before them.
+//
+//  This module does not depend on the libc or any other host system
+//  dependant function.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include "player.h"
+#include "patterns.h"
+
+//
+
+static int mt_samePattern( struct module *m, int a, int b ) {
+	const unsigned int *pa = m->patterns + a * m->patternSize;
+	const unsigned int *pb = m->patterns + b * m->patternSize;
+	int n;
+
+	for (n = 0; n < m->patternSize; n++) {
+		if (pa[n] != pb[n]) { return 0; }
+	}
+	return 1;
+}
+
+//
+// Packs pattern p into dst and returns its size. With a NULL dst only
+// the size gets calculated.
+//
+
+static int mt_packPattern( struct module *m, int p, unsigned char *dst ) {
+	const unsigned int *src = m->patterns + p * m->patternSize;
+	unsigned short *mask = (unsigned short *)dst;
+	unsigned int *cell = (unsigned int *)(dst + PACKEDHDR);
+	int len = PACKEDHDR;
+	int r, n, k;
+
+	for (r = 0; r < 64; r++) {
+		for (n = k = 0; n < m->numCh; n++, src++) {
+			if (*src == 0) { continue; }
+			if (dst) { *cell++ = *src; }
+			k |= 1 << n;
+			len += sizeof(unsigned int);
+		}
+		if (dst) { mask[r] = k; }
+	}
+	return len;
+}
+
+//
+// Packs the patterns of the module into mem (32 bits aligned) and makes
+// the player use them. Returns the number of bytes used or -1 if they
+// do not fit into size bytes. With a NULL mem only the needed size gets
+// returned. After this the player does not read the raw patterns of the
+// module image anymore.
+//
+
+int mt_packPatterns( struct module *m, void *mem, int size ) {
+	unsigned int *offset = (unsigned int *)mem;
+	int len = m->numPatterns * sizeof(unsigned int);
+	int p, q, n;
+
+	if (m->patterns == 0) { return -1; }
+
+	// the offset table comes first
+	if (mem && len > size) { return -1; }
+
+	for (p = 0; p < m->numPatterns; p++) {
+		for (q = 0; q < p; q++) {
+			if (mt_samePattern( m, p, q )) { break; }
+		}
+		if (q < p) {
+			if (mem) { offset[p] = offset[q]; }
+			continue;
+		}
+		n = mt_packPattern( m, p, (unsigned char *)0 );
+
+		if (mem) {
+			if (len + n > size) { return -1; }
+			mt_packPattern( m, p, (unsigned char *)mem + len );
+			offset[p] = len;
+		}
+		len += n;
+	}
+	if (mem) {
+		m->sbuf->enterCriticalSection( m->sbuf );
+		m->rowCursor.cell = (const unsigned int *)0;
+		m->rowSongPos = -1;
+		m->packed = (const unsigned char *)mem;
+		m->sbuf->leaveCriticalSection( m->sbuf );
+	}
+	return len;
+}
+
+//
+// Returns the cells of the row at songPos/patternPos. Raw patterns get
+// returned in place. Compact ones get decoded into row, continuing from
+// the cursor if it points to the row.
+//
+
+const unsigned char *mt_patternRow( struct module *m, struct rowCursor *cur,
+                                    int songPos, int patternPos, unsigned int *row ) {
+	const unsigned char *patt;
+	const unsigned short *mask;
+	const unsigned int *cell;
+	int p = m->songPositions[songPos];
+	int r, n, k;
+
+	if (m->packed == 0) {
+		return (const unsigned char *)&m->patterns[p * m->patternSize + patternPos];
+	}
+	patt = m->packed + ((const unsigned int *)m->packed)[p];
+	mask = (const unsigned short *)patt;
+	r = patternPos / m->numCh;
+
+	if (cur->cell && cur->songPos == songPos && cur->patternPos == patternPos) {
+		cell = cur->cell;
+	} else {
+		cell = (const unsigned int *)(patt + PACKEDHDR);
+
+		for (n = 0; n < r; n++) {
+			for (k = mask[n]; k; k &= k - 1) { cell++; }
+		}
+	}
+	for (n = 0, k = mask[r]; n < m->numCh; n++, k >>= 1) {
+		row[n] = k & 1 ? *cell++ : 0;
+	}
+	cur->songPos    = songPos;
+	cur->patternPos = patternPos + m->numCh;
+	cur->cell       = cell;
+	return (const unsigned char *)row;
+}
+
+//
+// Decodes the row at the current position into rowBuf. The player calls
+// this right after playing a row, so the next row is ready in advance.
+//
+
+void mt_prefetchRow( struct module *m ) {
+	mt_patternRow( m, &m->rowCursor, m->songPos, m->patternPos, m->rowBuf );
+	m->rowSongPos    = m->songPos;
+	m->rowPatternPos = m->patternPos;
+}
@@ -45,6 +45,9 @@
 
 #include "player.h"
 #include "mixer.h"
+#include "cache.h"
+#include "patterns.h"
+#include "prerender.h"
 
 //
 
@@ -82,72 +85,153 @@ static void mt_noteCut( struct module *mod, int n );
 static void mt_noteDelay( struct module *mod, int n );
 static void mt_patternDelay( struct module *mod, int n );
 static void mt_setTonePorta( struct module *mod, int n );
-static int strncmp_( char *, char *, int );
+static void mt_tickPortaUp( struct module *mod, int n );
+static void mt_tickPortaDown( struct module *mod, int n );
+static int strncmp_( const char *, const char *, int );
 
+//
+// Tick handlers for the non-row ticks, by effect and by E command. A
+// channel gets bound to one of these when its row is read.
 //
 
-int mt_init( char *data, struct soundBufParams *sbuf, struct module *mod ) {
-	char *samples, *instr;
-	int n, v, l;
+typedef void (*tickHandler)( struct module *, int );
 
-	for (n = 0; n < sizeof(struct module); n++) {
-		((char *)mod)[n] = 0;
+static const tickHandler mt_tickEffectTable[16] = {
+	mt_arpeggio, mt_tickPortaUp, mt_tickPortaDown, mt_tonePortamento,
+	mt_vibrato, mt_tonePlusVolSlide, mt_vibratoPlusVolSlide, mt_tremolo,
+	0, 0, mt_volumeSlide, 0, 0, 0, 0, 0
+};
+static const tickHandler mt_tickECommandTable[16] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, mt_retrigNote, 0, 0, mt_noteCut, mt_noteDelay, 0, 0
+};
+
+//
+
+//
+// Copies the start of the sample with the first SAMPLEHEAD bytes cleared.
+// Samples that already start with them cleared do not need the copy.
+//
+
+static void mt_sampleHead( struct _instruments *ins ) {
+	const signed char *s = ins->sampleStart;
+	int n;
+
+	ins->dirtyHead = 0;
+
+	for (n = 0; n < SAMPLEHEAD * 2; n++) {
+		if (n < SAMPLEHEAD) {
+			ins->head[n] = 0;
+
+			if (n < ins->sampleLen && s[n]) { ins->dirtyHead = 1; }
+		} else {
+			ins->head[n] = n < ins->sampleLen ? s[n] : 0;
+		}
 	}
+}
 
-	mod->sbuf = sbuf;
-	mod->moduleData = data;
+//
+// The interpolation of the last sample reads the byte after the end,
+// which can be the start of the next sample. Copies the last byte with
+// a cleared one after it if that start was not cleared in the image.
+//
 
-	// check for a NULL module.. handy if one just wants to use sound FXs
-	if (data == (char *)0) {
-		mod->enable = 0;
-		mod->sbuf->start( mod->sbuf );
-		return 0;
+static void mt_sampleTail( struct module *mod, int n ) {
+	struct _instruments *ins = &mod->instruments[n];
+	const signed char *e = ins->sampleStart + ins->length;
+	const signed char *s;
+	int i, l;
+
+	ins->dirtyTail = 0;
+
+	if (ins->length == 0) { return; }
+
+	for (i = n + 1; i < mod->numInstruments; i++) {
+		s = mod->instruments[i].sampleStart;
+		l = mod->instruments[i].sampleLen < SAMPLEHEAD ? mod->instruments[i].sampleLen : SAMPLEHEAD;
+
+		if (e >= s && e < s + l && *e) {
+			ins->tail[0] = e[-1];
+			ins->tail[1] = 0;
+			ins->dirtyTail = 1;
+			return;
+		}
 	}
+}
 
-	// Parse module.. start with the name..
-	mod->modName = data; data += 20;
-	instr = data;
-  
-	// check module type and number of channels & samples
-	mod->numInstruments = 31;
-	mod->numCh = 4;
-	if (!strncmp_(data+1080-20,"M.K.",4)) {
-	} else if (!strncmp_(data+1080-20,"M!K!",4)) {
-	} else if (!strncmp_(data+1080-20,"FLT4",4)) {
-	} else if (!strncmp_(data+1080-20,"FLT8",4)) {
-		mod->numCh   = 8;	// not really handled correctly :(
-	} else if (!strncmp_(data+1080-20,"4CHN",4)) {
-		mod->numCh   = 4;
-	} else if (!strncmp_(data+1080-20,"6CHN",4)) {
-		mod->numCh   = 6;
-	} else if (!strncmp_(data+1080-20,"8CHN",4)) {
-		mod->numCh   = 8;
-	} else if (!strncmp_(data+1080-20,"10CH",4)) {
-		mod->numCh   = 10;
-	} else if (!strncmp_(data+1080-20,"12CH",4)) {
-		mod->numCh   = 12;
-	} else if (!strncmp_(data+1080-20,"14CH",4)) {
-		mod->numCh   = 14;
-	} else if (!strncmp_(data+1080-20,"16CH",4)) {
-		mod->numCh   = 16;
+//
+// Checks the module type. Returns the number of instruments and the
+// number of channels in *numCh.
+//
+
+static int mt_modType( const char *data, int *numCh ) {
+	data += 1080;
+	*numCh = 4;
+
+	if (!strncmp_(data,"M.K.",4)) {
+	} else if (!strncmp_(data,"M!K!",4)) {
+	} else if (!strncmp_(data,"FLT4",4)) {
+	} else if (!strncmp_(data,"FLT8",4)) {
+		*numCh = 8;	// not really handled correctly :(
+	} else if (!strncmp_(data,"4CHN",4)) {
+		*numCh = 4;
+	} else if (!strncmp_(data,"6CHN",4)) {
+		*numCh = 6;
+	} else if (!strncmp_(data,"8CHN",4)) {
+		*numCh = 8;
+	} else if (!strncmp_(data,"10CH",4)) {
+		*numCh = 10;
+	} else if (!strncmp_(data,"12CH",4)) {
+		*numCh = 12;
+	} else if (!strncmp_(data,"14CH",4)) {
+		*numCh = 14;
+	} else if (!strncmp_(data,"16CH",4)) {
+		*numCh = 16;
 	} else {
 		// the module is MOST probably old 15 instrument & 4 channel mod.
-		mod->numInstruments = 15;
+		return 15;
 	}
+	return 31;
+}
+
+//
+// Parses the module header, song positions and instrument infos. If
+// a sample cache is given the sample data is not expected to follow
+// the patterns in memory and only the file offsets get recorded.
+//
+// The module image is only read, never written. It can live in ROM/flash
+// or be mapped read-only and several players can share the same image.
+// Loading is just parsing the header - no sample data gets copied or
+// touched. The old versions cleared the first SAMPLEHEAD bytes of every
+// sample like ProTracker does. Those get played from cleared copies in
+// the instrument instead, see mt_sampleHead() and mt_sampleTail().
+//
+
+static int mt_parse( const char *data, struct module *mod, struct sampleCache *c ) {
+	const char *samples, *instr;
+	int n, v, l, numCh;
+
+	// Parse module.. start with the name..
+	mod->modName = data;
+	instr = data + 20;
+  
+	// check module type and number of channels & samples
+	mod->numInstruments = mt_modType( data, &numCh );
+	mod->numCh = numCh;
+
 	if (mod->numCh  > MAX_MOD_CHANNELS) {
 		return -1;
 	}
 	// Skip intrument infos
-	data += mod->numInstruments * 30;
+	data += 20 + mod->numInstruments * 30;
 	// song length
 	mod->songLen = *data++;
 	// ciaa	
 	mod->ciaa = *data++;
 	// Song positions.. and find the size of pattern data..
-	mod->songPositions = data;
+	mod->songPositions = (const unsigned char *)data;
   
 	for (n = v = 0; n < mod->songLen; n++) {
-		if (data[n] > v) { v = data[n]; } 
+		if (mod->songPositions[n] > v) { v = mod->songPositions[n]; } 
 	}
 	if (mod->numInstruments == 15) {
 		data += 128;
@@ -155,7 +239,7 @@ int mt_init( char *data, struct soundBufParams *sbuf, struct module *mod ) {
 		data += 132;
 	}
 	mod->numPatterns = v + 1;
-	mod->patterns   = (unsigned long *)data;
+	mod->patterns   = (const unsigned int *)data;
 	mod->patternSize = 64 * mod->numCh;
 	samples = data + mod->numCh * 256 * mod->numPatterns;	// pointer to the first sample..
   
@@ -165,8 +249,13 @@ int mt_init( char *data, struct soundBufParams *sbuf, struct module *mod ) {
 		mod->instruments[n].sampleLen = (((instr[0] & 0x7f) << 8)  | (instr[1] & 0xff)) << 1; instr += 2;
 		mod->instruments[n].finetune = *instr++;
 		mod->instruments[n].volume   = *instr++;
-		mod->instruments[n].sampleStart = samples;
-		samples[0] = 0; samples[1] = 0; samples[2] = 0; samples[3] = 0;
+
+		if (c) {
+			c->offset[n] = samples - mod->moduleData;
+		} else {
+			mod->instruments[n].sampleStart = (const signed char *)samples;
+			mt_sampleHead( &mod->instruments[n] );
+		}
     
 		v = (((instr[0] & 0xff) << 8)  | (instr[1] & 0xff)) << 1; instr += 2;	// repeat
 		l = (((instr[0] & 0xff) << 8)  | (instr[1] & 0xff)) << 1; instr += 2;	// replen
@@ -186,18 +275,150 @@ int mt_init( char *data, struct soundBufParams *sbuf, struct module *mod ) {
 		}
 		samples += mod->instruments[n].sampleLen;
 	}
+	for (n = 0; n < mod->numInstruments && c == 0; n++) {
+		mt_sampleTail( mod, n );
+	}
 	// The rest..
   
 	mod->songPos = 0;	//
 	mod->speed = 6;
 	mod->count = 6;
 	mod->enable = 1;
-	mt_setSpeed( mod, 125 );
+	mod->bpm = 125;		// the sound buffer gets set when started
+	return 0;
+}
+
+static void mt_reset( const char *data, struct soundBufParams *sbuf, struct module *mod ) {
+	int n;
+
+	for (n = 0; n < sizeof(struct module); n++) {
+		((char *)mod)[n] = 0;
+	}
+
+	mod->sbuf = sbuf;
+	mod->moduleData = data;
+	mod->musicGain = UNITYGAIN;
+	mod->busGain[BUS_MUSIC] = UNITYGAIN;
+	mod->busGain[BUS_FX] = UNITYGAIN;
+	mod->duck = UNITYGAIN;
+#ifdef ASMMIXER
+	mod->interpolate = 0;
+#else
+	mod->interpolate = 1;
+#endif
+}
+
+int mt_init( const char *data, struct soundBufParams *sbuf, struct module *mod ) {
+	mt_reset( data, sbuf, mod );
+
+	// check for a NULL module.. handy if one just wants to use sound FXs
+	if (data == (const char *)0) {
+		mod->enable = 0;
+		mod->sbuf->start( mod->sbuf );
+		return 0;
+	}
+	if (mt_parse( data, mod, (struct sampleCache *)0 ) < 0) {
+		return -1;
+	}
+	mt_setSpeed( mod, mod->bpm );
 
 	mod->sbuf->start( mod->sbuf );
 	return 0;
 }
 
+//
+// Parses the module into next for a later mt_switch() from cur. The
+// sound buffer of cur keeps playing undisturbed. Can be called from the
+// main loop while cur is playing.
+//
+
+int mt_prepare( const char *data, struct module *next, struct module *cur ) {
+	mt_reset( data, cur->sbuf, next );
+	next->interpolate = cur->interpolate;
+	next->halfRate = cur->halfRate;
+
+	if (data == (const char *)0) {
+		next->enable = 0;
+		return 0;
+	}
+	return mt_parse( data, next, (struct sampleCache *)0 );
+}
+
+//
+// Switches from cur to the prepared module next without stopping the
+// sound buffer. With ticks 0 the switch happens at the next row of cur,
+// otherwise cur gets crossfaded into next over ticks ticks of next. cur
+// keeps its own tempo meanwhile. FX channels keep playing. After the
+// switch next is the playing module and gets called by the sound buffer
+// - use it for mt_playFX() etc. and mt_end().
+//
+
+int mt_switch( struct module *cur, struct module *next, int ticks ) {
+	if (next->sbuf != cur->sbuf || next == cur || mt_switching( cur ) || cur->ring) {
+		return -1;
+	}
+	cur->sbuf->enterCriticalSection( cur->sbuf );
+	cur->fadeTicks = ticks > 0 ? ticks : 0;
+	cur->next = next;
+	next->pending = 1;
+	cur->sbuf->leaveCriticalSection( cur->sbuf );
+	return 0;
+}
+
+//
+// Returns 1 while the module has a pending switch or a crossfade is
+// going on. The faded out module can be reused after this returns 0.
+//
+
+int mt_switching( struct module *m ) {
+	return m->next || m->pending || m->fadeOut || m->fadingOut;
+}
+
+//
+// Same as mt_init() but only the module header and the patterns need to
+// be in memory (see mt_headerSize()). The sample data gets loaded into
+// the sample cache when the pattern look-ahead finds them. The cache must
+// be initialized with mt_initCache() before calling this.
+//
+
+int mt_initLazy( const char *hdr, struct sampleCache *c,
+                 struct soundBufParams *sbuf, struct module *mod ) {
+	mt_reset( hdr, sbuf, mod );
+	mod->cache = c;
+
+	if (mt_parse( hdr, mod, c ) < 0) {
+		return -1;
+	}
+	mt_setSpeed( mod, mod->bpm );
+
+	// Get the instruments of the first rows in before starting..
+	mt_cacheLookAhead( mod );
+	mt_serviceCache( mod );
+
+	mod->sbuf->start( mod->sbuf );
+	return 0;
+}
+
+//
+// Returns the size of the module header + patterns i.e. the part of the
+// module that has to be in memory for mt_initLazy(). At least the first
+// 1084 bytes of the module must be given.
+//
+
+int mt_headerSize( const char *data ) {
+	const unsigned char *pos;
+	int numIns, numCh, n, v;
+
+	numIns = mt_modType( data, &numCh );
+	pos = (const unsigned char *)data + 20 + numIns * 30;
+
+	for (n = v = 0; n < pos[0]; n++) {
+		if (pos[2+n] > v) { v = pos[2+n]; }
+	}
+	return (pos + (numIns == 15 ? 130 : 134) - (const unsigned char *)data) +
+		numCh * 256 * (v + 1);
+}
+
 void mt_end( struct module *m ) {
 	m->sbuf->stop( m->sbuf );
 }
@@ -213,45 +434,149 @@ void mt_masterVolume( struct module *m, int volume ) {
 	m->sbuf->volume( volume );
 }
 
+void mt_interpolation( struct module *m, int on ) {
+	m->interpolate = on ? 1 : 0;
+}
+
+//
+// Mixes the voices at half realFreq and upsamples the mix to realFreq
+// before the output conversion. Halves the mixing work of every voice.
+//
+
+void mt_halfRate( struct module *m, int on ) {
+	int n;
+
+	m->halfRate = 0;
+
+	for (n = 0; n < 3; n++) {
+		m->upState[n] = 0;
+	}
+	m->halfRate = on ? 1 : 0;
+}
+
+//
+// Selects the emulated Amiga output filters. The LED filter follows the
+// E0x command of the module. The coefficients are w/(1+w), w=2*pi*fc/fs,
+// of a one-pole low-pass. The LED filter is two cascaded one-poles.
+//
+
+static int filterCoef( long freq, int fc ) {
+	int w = 6283 * fc / freq;	// w * 1000
+
+	return (w << 8) / (1000 + w);
+}
+
+void mt_amigaFilter( struct module *m, int model ) {
+	int n;
+
+	m->amigaModel = 0;
+	m->filterCoef[0] = model == AMIGA_A500 ? filterCoef( m->sbuf->realFreq, 4420 ) : 0;
+	m->filterCoef[1] = filterCoef( m->sbuf->realFreq, 3275 );
+
+	for (n = 0; n < 3; n++) {
+		m->filterState[n] = 0;
+	}
+	m->amigaModel = model == AMIGA_A500 || model == AMIGA_A1200 ? model : AMIGA_NONE;
+}
+
+//
+// Sets the software gain of a submix bus, 8.8 fixed point up to 4.0. The
+// gains get applied to the voice volumes, so they cost nothing per sample.
+//
+
+void mt_busGain( struct module *m, int bus, int gain ) {
+	if (bus < 0 || bus >= MT_BUSES) { return; }
+	if (gain < 0) { gain = 0; }
+	if (gain > 4 * UNITYGAIN) { gain = 4 * UNITYGAIN; }
+
+	m->busGain[bus] = gain;
+}
+
+//
+// Ducks the music bus to gain while any FX channel plays. The gain
+// slides down and back up over ticks. ticks 0 turns ducking off.
+//
+
+void mt_ducking( struct module *m, int gain, int ticks ) {
+	if (gain < 0) { gain = 0; }
+	if (gain > UNITYGAIN) { gain = UNITYGAIN; }
+
+	m->duckGain = gain;
+	m->duckStep = ticks > 0 ? (UNITYGAIN - gain + ticks - 1) / ticks : 0;
+
+	if (m->duckStep == 0) {
+		m->duck = UNITYGAIN;
+	}
+}
+
+static void mt_duck( struct module *m ) {
+	if (m->playing & MOD_MASK) {
+		m->duck -= m->duckStep;
+		if (m->duck < m->duckGain) { m->duck = m->duckGain; }
+	} else {
+		m->duck += m->duckStep;
+		if (m->duck > UNITYGAIN) { m->duck = UNITYGAIN; }
+	}
+}
+
 void mt_setCallback( void (*cb)(int , int, void * ), void * data, struct module *m ) {
 	m->userCallback = cb;
 	m->userData     = data;
 }
 
+//
+// A period the mixer can not step through: the step of a period above
+// calcFreq << PRECISION rounds to 0 and the voice would never end.
 //
 
+static int mt_badPeriod( struct module *m, long period ) {
+	if (period <= 0 || period > 0x7fff) { return 1; }
+	return m->sbuf->calcFreq && period > m->sbuf->calcFreq << PRECISION;
+}
+
 int mt_playNote( struct FXinfo *n, struct module *m ) {
 	int ch = MAX_MOD_CHANNELS + n->channel;
 	int sm = n->instrument;
 
 	if (ch >= MAX_SUPPORTED_CHANNELS) { return -1; }
+	if (m->instruments[sm].sampleStart == 0) { return -1; }
+	if (mt_badPeriod( m, n->freq.period )) { return -1; }
+	if (m->cache) { mt_cacheTouch( m, sm ); }
 
 	m->channels[ch].volume      = n->volume;
-	m->channels[ch].finalVolume = n->volume;
+	m->voices[ch].finalVolume = n->volume;
 	m->channels[ch].period      = n->freq.period;
-	m->channels[ch].finalPeriod = n->freq.period;
-	m->channels[ch].start       = m->instruments[sm].sampleStart;
-	m->channels[ch].loopstart   = m->instruments[sm].loopStart;
-	m->channels[ch].length      = m->instruments[sm].length;
-	m->channels[ch].looped      = m->instruments[sm].looped;
-	m->channels[ch].pos         = m->instruments[sm].loopStart << PRECISION;
+	m->voices[ch].finalPeriod = n->freq.period;
+	m->voices[ch].start       = m->instruments[sm].sampleStart;
+	m->voices[ch].loopstart   = m->instruments[sm].loopStart;
+	m->voices[ch].length      = m->instruments[sm].length;
+	m->voices[ch].looped      = m->instruments[sm].looped;
+	m->voices[ch].pos         = m->instruments[sm].loopStart << PRECISION;
+	m->channels[ch].sample      = sm + 1;
 	m->playing |= (1 << ch);
 	return 0;
 }
-int mt_playFX( signed char *smp, int len, struct FXinfo *n, struct module *m ) {
+int mt_playFX( const signed char *smp, int len, struct FXinfo *n, struct module *m ) {
 	int ch = MAX_MOD_CHANNELS + n->channel;
+	long period;
 
 	if (ch >= MAX_SUPPORTED_CHANNELS) { return -1; }
+	if (n->freq.playFreq <= 0) { return -1; }
+
+	period = m->sbuf->clockConstant / n->freq.playFreq;
+
+	if (mt_badPeriod( m, period )) { return -1; }
 
 	m->channels[ch].volume      = n->volume;
-	m->channels[ch].finalVolume = n->volume;
-	m->channels[ch].period      = m->sbuf->clockConstant / n->freq.playFreq;
-	m->channels[ch].finalPeriod = m->sbuf->clockConstant / n->freq.playFreq;
-	m->channels[ch].start       = smp;
-	m->channels[ch].loopstart   = 0;
-	m->channels[ch].length      = len;
-	m->channels[ch].looped      = 0;
-	m->channels[ch].pos         = 0;
+	m->voices[ch].finalVolume = n->volume;
+	m->channels[ch].period      = period;
+	m->voices[ch].finalPeriod = period;
+	m->voices[ch].start       = smp;
+	m->voices[ch].loopstart   = 0;
+	m->voices[ch].length      = len;
+	m->voices[ch].looped      = 0;
+	m->voices[ch].pos         = 0;
+	m->channels[ch].sample      = 0;
 	m->playing |= (1 << ch);
 	return 0;
 }
@@ -262,8 +587,12 @@ void mt_stopFX( int ch, struct module *m ) {
 
 //
 
-int mt_music( void *mod, void *magic ) {
-	struct module *m = (struct module *)mod;
+//
+// Processes one tick. Also called by mt_servicePreRender() and
+// mt_bakeSong().
+//
+
+void mt_tick( struct module *m ) {
 	if (m->enable) {
 		if (++m->count < m->speed) {
 			mt_noNewNote( m );
@@ -271,7 +600,12 @@ int mt_music( void *mod, void *magic ) {
 			int d;
       
 			m->count = 0;
-      
+
+			m->row = m->patternPos / m->numCh;
+
+			if (m->evMask & (1 << EV_ROW)) {
+				mt_postEvent( m, EV_ROW, 0, m->songPos, m->row, 0, 0 );
+			}
 			if (m->pattDelTime2) {
 				mt_noNewNote( m );
 			} else {
@@ -308,86 +642,309 @@ int mt_music( void *mod, void *magic ) {
 				m->patternPos = 0;
 			}
 		}
+		if (m->packed && m->count == 0) {
+			mt_prefetchRow( m );
+		}
+		if (m->cache && m->count == 0) {
+			mt_cacheLookAhead( m );
+
+			if (m->cache->flags & CACHE_SYNC) {
+				mt_serviceCache( m );
+			}
+		}
 	} else {
 		m->playing &= MOD_MASK;
 	}
+}
 
-	// call the mixer and output the sound..
-	mixer( m );
+static void mt_copy( void *dst, const void *src, int len ) {
+	int n;
+
+	for (n = 0; n < len / sizeof(int); n++) {
+		((int *)dst)[n] = ((const int *)src)[n];
+	}
+}
+
+//
+// Makes cur->next the playing module. Called from the mixing context
+// at a tick boundary.
+//
+
+static struct module *mt_handOver( struct module *cur ) {
+	struct module *m = cur->next;
+	int ch;
+
+	// FX channels keep playing..
+	for (ch = MAX_MOD_CHANNELS; ch < MAX_SUPPORTED_CHANNELS; ch++) {
+		if ((cur->playing & (1 << ch)) && !(m->playing & (1 << ch))) {
+			mt_copy( &m->voices[ch], &cur->voices[ch], sizeof(struct _voices) );
+			mt_copy( &m->channels[ch], &cur->channels[ch], sizeof(struct _channels) );
+			m->playing |= 1 << ch;
+		}
+	}
+	// ..and so do the output settings and the events
+	m->frames      = cur->frames;
+	m->evMask      = cur->evMask;
+	m->stateEnable = cur->stateEnable;
+	m->amigaModel  = cur->amigaModel;
+	m->halfRate    = cur->halfRate;
+	m->renderFrac  = cur->renderFrac;
+	m->renderDen   = cur->renderDen;
+	m->duckGain    = cur->duckGain;
+	m->duckStep    = cur->duckStep;
+	m->duck        = cur->duck;
+	mt_copy( m->busGain, cur->busGain, sizeof(m->busGain) );
+	mt_copy( m->filterCoef, cur->filterCoef, sizeof(m->filterCoef) );
+	mt_copy( m->filterState, cur->filterState, sizeof(m->filterState) );
+	mt_copy( m->upState, cur->upState, sizeof(m->upState) );
+
+	cur->evMask = 0;
+	cur->stateEnable = 0;
+	cur->playing &= ~MOD_MASK;
+	cur->next = (struct module *)0;
+	m->pending = 0;
+
+	if (cur->fadeTicks) {
+		cur->fadingOut = 1;
+		cur->fadeDue   = m->bpm;
+		m->fadeOut   = cur;
+		m->fadeTicks = cur->fadeTicks;
+		m->fadePos   = 0;
+		m->musicGain = 0;
+		cur->fadeTicks = 0;
+	} else {
+		cur->playing = 0;
+	}
+	m->sbuf->callbackData = m;
+	mt_setSpeed( m, m->bpm );
+	return m;
+}
+
+//
+// Ticks the module being faded out at its own tempo. fadeDue counts
+// its time in bpm units: a tick of it is due every m->bpm and every
+// tick of m adds its own bpm. The ticks land on the ticks of m, so it
+// ticks twice now and then when faded into a slower module and skips
+// ticks when faded into a faster one.
+//
+
+static void mt_fadeTick( struct module *m ) {
+	struct module *o = m->fadeOut;
+
+	while (o->fadeDue >= m->bpm) {
+		mt_tick( o );
+		o->fadeDue -= m->bpm;
+	}
+	o->fadeDue += o->bpm;
+}
+
+//
+// Advances the crossfade by one tick.
+//
+
+static void mt_fade( struct module *m ) {
+	struct module *o = m->fadeOut;
+
+	if (++m->fadePos >= m->fadeTicks) {
+		m->musicGain = UNITYGAIN;
+		o->playing = 0;
+		o->fadingOut = 0;
+		m->fadeOut = (struct module *)0;
+		return;
+	}
+	m->musicGain = UNITYGAIN * m->fadePos / m->fadeTicks;
+	o->musicGain = UNITYGAIN - m->musicGain;
+}
+
+//
+// Starts a new tick of the playing module, which can change at a
+// module switch. Returns the module.
+//
+
+static struct module *mt_startTick( struct module *m ) {
+	if (m->next && (m->fadeTicks || !m->enable || m->count + 1 >= m->speed)) {
+		m = mt_handOver( m );
+	}
+	if (m->fadeOut) {
+		mt_fadeTick( m );
+		mt_fade( m );
+	}
+	if (m->ring) {
+		mt_nextRendered( m );
+	} else {
+		mt_tick( m );
+	}
+
+	if (m->duckStep) {
+		mt_duck( m );
+	}
+	return m;
+}
+
+//
+// Ends the first output of a tick of len frames.
+//
+
+static void mt_endTick( struct module *m, int len ) {
+	// nothing changes while disabled and silent..
+	if (m->stateEnable && (m->enable || m->silent < 2)) {
+		mt_publishState( m );
+	}
+	m->frames += len;
 
 	// check callback..
 	if (m->userCallback) {
 		m->userCallback( m->songPos, m->patternPos, m->userData );
 	}
-	
+}
+
+int mt_music( void *mod, void *magic ) {
+	struct module *m = mt_startTick( (struct module *)mod );
+
+	// call the mixer and output the sound..
+	mixer( m );
+
+	if (m->ring) {
+		mt_doneRendered( m );
+	}
+	mt_endTick( m, m->sbuf->len / m->sbuf->stereo );
 	return 0;
 }
 
-static void mt_noNewNote( struct module *mod ) {
+//
+// Returns the length of the next tick in output frames. The remainder
+// gets carried to the next tick, so the tempo is exact over time. At
+// half rate the ticks are an even number of frames.
+//
+
+static int mt_tickFrames( struct module *m ) {
+	struct soundBufParams *sb = m->sbuf;
+	int den = (sb->tickFreq * sb->bpm) << m->halfRate;
 	int n;
-	for (n = 0; n < mod->numCh; n++) {
-		if (mod->channels[n].period == 0) {
-			continue;
-		}
-		switch (mod->channels[n].effect) {
-		case 0x00:	// mt_arpeggio
-			if (mod->channels[n].params) {
-				mt_arpeggio( mod, n );
+
+	if (den != m->renderDen) {
+		if (m->renderDen) {
+			m->renderFrac = m->renderFrac * den / m->renderDen;
+		}
+		m->renderDen = den;
+	}
+	m->renderFrac += sb->realFreq * 125;
+	n = m->renderFrac / den;
+	m->renderFrac -= n * den;
+	return n << m->halfRate;
+}
+
+//
+// Renders frames output frames into out in the format of the sound
+// buffer, for hosts that pull the sound instead of running the sound
+// buffer. Ticks continue across calls. After a mt_switch() pass the
+// sbuf->callbackData like for mt_music(). mt_music() must not be used
+// on the same module. Returns the frames rendered, or -1 with
+// pre-rendered music.
+//
+
+int mt_render( struct module *m, void *out, int frames ) {
+	struct soundBufParams *sb = m->sbuf;
+	int size = sb->sampleSize * sb->stereo;
+	char *o = (char *)out;
+	int done, first, n, i, max;
+
+	if (m->ring || frames < 0 || sb->bpm <= 0) { return -1; }
+
+	// sbuf->tmp holds a bpm 32 buffer, a tick rounded up can be a frame
+	// longer and gets mixed in two parts then
+
+	max = calcBufferSize( sb, 1, 32 ) / sb->stereo;
+	done = 0;
+
+	if (m->renderHeld && frames > 0) {
+		for (i = 0; i < size; i++) {
+			*o++ = ((const char *)m->renderHold)[size + i];
+		}
+		m->renderHeld = 0;
+		done++;
+	}
+	while (done < frames) {
+		first = m->renderLeft == 0;
+
+		if (first) {
+			m = mt_startTick( m );
+			m->renderLeft = mt_tickFrames( m );
+		}
+
+		// at half rate mix an even number of frames, a single last
+		// frame gets mixed as a pair and the second one kept
+
+		n = frames - done < m->renderLeft ? frames - done : m->renderLeft;
+		n = n < max ? n : max;
+		n &= ~m->halfRate;
+
+		if (n) {
+			mixFrames( m, o, n );
+			o += n * size;
+			done += n;
+		} else {
+			n = 2;
+			mixFrames( m, (char *)m->renderHold, n );
+
+			for (i = 0; i < size; i++) {
+				o[i] = ((const char *)m->renderHold)[i];
 			}
-			break;
-		case 0x01:	// mt_portaUp			//!
-			mt_portaUp( mod, n, 0xff );
-			break;
-		case 0x02:	// mt_portaDown
-			mt_portaDown( mod, n, 0xff );
-			break;
-		case 0x03:	// mt_TonePortamento
-			mt_tonePortamento( mod, n );
-			break;
-		case 0x04:	// mt_Vibrato			//!
-			mt_vibrato( mod, n );
-			break;
-		case 0x05:	// mt_TonePlusVolSlide		// done
-			mt_tonePlusVolSlide( mod, n );
-			break;
-		case 0x06:	// mt_VibratoPlusVolSlide	// done
-			mt_vibratoPlusVolSlide( mod, n );
-			break;
-		case 0x07:	// mt_Tremolo				// done
-			mt_tremolo( mod, n );
-			break;
-		case 0x0a:	// mt_VolumeSlide		//!
-			mt_volumeSlide( mod, n );
-			break;
-		case 0x0e:	// mt_E_Commands
-			switch (mod->channels[n].params >> 4) {
-			case 0x09:	// mt_RetrigNote		// 
-				mt_retrigNote( mod, n );
-				break;
-			case 0x0c:	// mt_NoteCut
-				mt_noteCut( mod, n );
-				break;
-			case 0x0d:	// mt_NoteDelay
-				mt_noteDelay( mod, n );
-				break;
+			m->renderHeld = 1;
+			done++;
+		}
+		m->renderLeft -= n;
+
+		if (m->renderLeft < 0) {
+			m->renderLeft = 0;	// mt_halfRate() during an odd tick
+		}
+		if (first) {
+			mt_endTick( m, n );
+		} else {
+			m->frames += n;
+		}
+	}
+	return done;
+}
+
+//
+// Runs the tick handlers bound by mt_getNewNote(). Only the channels
+// with a tick based effect on their row get visited.
+//
+
+static void mt_noNewNote( struct module *mod ) {
+	unsigned long active = mod->tickEffects;
+	int n;
+
+	for (n = 0; active; n++) {
+		if (active & (1 << n)) {
+			active &= ~(1 << n);
+
+			if (mod->channels[n].period) {
+				mod->channels[n].tickEffect( mod, n );
 			}
-			break;
-		default:
-			return;
 		}
 	}
 }
 
 static void mt_getNewNote( struct module *m ) {
 	unsigned char params, sample, effect;
-	unsigned char *patt;
+	const unsigned char *patt;
 	short period;
-	int n;
+	int n, trig;
   
-	patt = (unsigned char*)&m->patterns[(m->songPositions[m->songPos] *
-			m->patternSize) + m->patternPos];
+	if (m->packed) {
+		if (m->rowSongPos != m->songPos || m->rowPatternPos != m->patternPos) {
+			mt_prefetchRow( m );
+		}
+		patt = (const unsigned char *)m->rowBuf;
+	} else {
+		patt = (const unsigned char*)&m->patterns[(m->songPositions[m->songPos] *
+				m->patternSize) + m->patternPos];
+	}
   
 	m->playing &= MOD_MASK;
+	m->tickEffects = 0;
   
 	for (n = 0; n < m->numCh; n++) {
 		// Parse the Pattern Data Entry
@@ -404,6 +961,18 @@ static void mt_getNewNote( struct module *m ) {
 		m->channels[n].note   = period;
 		m->channels[n].effect = effect;
 		m->channels[n].params = params;
+		trig = 0;
+
+		// bind the tick handler, arpeggio without params is no effect
+    
+		if (effect == 0x0e) {
+			m->channels[n].tickEffect = mt_tickECommandTable[params >> 4];
+		} else {
+			m->channels[n].tickEffect = effect || params ? mt_tickEffectTable[effect] : 0;
+		}
+		if (m->channels[n].tickEffect) {
+			m->tickEffects |= 1 << n;
+		}
     
 		// Check if we got a note to play..
     
@@ -412,7 +981,7 @@ static void mt_getNewNote( struct module *m ) {
 		}
 		if (period > 0) {
 			if (sample == 0 && effect == 0 && params == 0) {
-				m->channels[n].pos = m->channels[n].loopstart << PRECISION;
+				m->voices[n].pos = m->voices[n].loopstart << PRECISION;
 			}
 			if ((effect == 0x0e) && (params >= 0x50)) {
 				m->channels[n].finetune = params & 0x0f;
@@ -432,6 +1001,7 @@ static void mt_getNewNote( struct module *m ) {
 					}
 				} else {
 					m->playing |= 1 << n;
+					trig = 1;
 				}
 				if (!(m->channels[n].wavecontrol & 0x04)) {
 					m->channels[n].vibratopos = 0;
@@ -442,12 +1012,16 @@ static void mt_getNewNote( struct module *m ) {
 				if (sample > 0) {
 					m->channels[n].sample    = sample;
 					m->channels[n].finetune  = m->instruments[sample-1].finetune;
-					m->channels[n].start     = m->instruments[sample-1].sampleStart;
-					m->channels[n].loopstart = m->instruments[sample-1].loopStart;
+					m->voices[n].start     = m->instruments[sample-1].sampleStart;
+					m->voices[n].loopstart = m->instruments[sample-1].loopStart;
 					m->channels[n].wavestart = m->instruments[sample-1].loopStart;
-					m->channels[n].length    = m->instruments[sample-1].length;
-					m->channels[n].looped    = m->instruments[sample-1].looped;
-					m->channels[n].pos       = m->instruments[sample-1].loopStart << PRECISION;
+					m->voices[n].length    = m->instruments[sample-1].length;
+					m->voices[n].looped    = m->instruments[sample-1].looped;
+					m->voices[n].pos       = m->instruments[sample-1].loopStart << PRECISION;
+
+					if (m->cache) {
+						mt_cacheTouch( m, sample-1 );
+					}
 				}
         
 				pt = &mt_periodTable[0][0];
@@ -462,6 +1036,9 @@ static void mt_getNewNote( struct module *m ) {
 		if (m->channels[n].period) {
 			m->playing |= 1 << n;
 		}
+		if (m->voices[n].start == 0) {
+			m->playing &= ~(1 << n);	// sample not in the cache (yet)
+		}
 
 		// check non tick based effects..
     
@@ -521,8 +1098,19 @@ static void mt_getNewNote( struct module *m ) {
 		default:
 			break;
 		}
-		m->channels[n].finalVolume = m->channels[n].volume;
-		m->channels[n].finalPeriod = m->channels[n].period;
+		m->voices[n].finalVolume = m->channels[n].volume;
+		m->voices[n].finalPeriod = m->channels[n].period;
+
+		if (m->evMask) {
+			if (trig && (m->evMask & (1 << EV_NOTE))) {
+				mt_postEvent( m, EV_NOTE, n, m->channels[n].sample,
+				              m->channels[n].volume, m->channels[n].period, 0 );
+			}
+			if ((effect == 0x08 || (effect == 0x0e && (params >> 4) == 0x08)) &&
+			    (m->evMask & (1 << EV_SYNC))) {
+				mt_postEvent( m, EV_SYNC, n, effect, params, 0, 0 );
+			}
+		}
 	} // for channels
 }
 
@@ -533,11 +1121,11 @@ static void mt_sampleOffset( struct module *m, int n ) {
 
 	o = m->channels[n].params << 8;
   
-	if (m->channels[n].length > o) {
-		m->channels[n].length -= o;
-		m->channels[n].start  += o;
+	if (m->voices[n].length > o) {
+		m->voices[n].length -= o;
+		m->voices[n].start  += o;
 	} else {
-		m->channels[n].length = 2;
+		m->voices[n].length = 2;
 	}
 }
 
@@ -585,17 +1173,22 @@ static void mt_tonePortNoChange( struct module *m, int n ) {
     
 		s = mt_periodTable[(int)m->channels[n].finetune][i];	//pt[i];
 	}
-	m->channels[n].finalPeriod = s;
+	m->voices[n].finalPeriod = s;
 }
 static void mt_noteDelay( struct module *m, int n ) {
 	if ((m->channels[n].params & 0x0f) == m->count) {
 		if (m->channels[n].period) {
 			int sample = m->channels[n].sample;
-			m->channels[n].loopstart = m->instruments[sample-1].loopStart;
+			m->voices[n].loopstart = m->instruments[sample-1].loopStart;
 			m->channels[n].wavestart = m->instruments[sample-1].loopStart;
-			m->channels[n].length    = m->instruments[sample-1].length;
-			m->channels[n].looped    = m->instruments[sample-1].looped;
-			m->channels[n].pos       = m->instruments[sample-1].loopStart << PRECISION;
+			m->voices[n].length    = m->instruments[sample-1].length;
+			m->voices[n].looped    = m->instruments[sample-1].looped;
+			m->voices[n].pos       = m->instruments[sample-1].loopStart << PRECISION;
+
+			if (m->evMask & (1 << EV_NOTE)) {
+				mt_postEvent( m, EV_NOTE, n, sample, m->channels[n].volume,
+				              m->channels[n].period, 0 );
+			}
 		}
 	}
 }
@@ -610,7 +1203,7 @@ static void mt_volumeChange( struct module *m, int n ) {
 	if ((v = m->channels[n].params) > 64) { v = 64; }
   
 	m->channels[n].volume = v;
-	m->channels[n].finalVolume = v;
+	m->voices[n].finalVolume = v;
 }
 static void mt_patternBreak( struct module *m, int n ) {
 	int p;
@@ -628,7 +1221,13 @@ static void mt_patternBreak( struct module *m, int n ) {
 static void mt_setSpeed( struct module *m, int bpm ) {
 	if (bpm) {
 		if (bpm >= 32) {
-			m->sbuf->len = calcBufferSize( m->sbuf, 1, bpm );
+			m->bpm = bpm;
+
+			// a module being faded out follows the tempo of the new one
+			if (!m->fadingOut) {
+				m->sbuf->bpm = bpm;
+				m->sbuf->len = calcBufferSize( m->sbuf, 1, bpm );
+			}
 		} else {
 			m->speed = bpm;
 		}
@@ -640,7 +1239,7 @@ static void mt_arpeggio( struct module *m, int n ) {
   
 	switch (m->count % 3) {
 	case 0:		// mt_arpeggio2
-		m->channels[n].finalPeriod = m->channels[n].period;
+		m->voices[n].finalPeriod = m->channels[n].period;
 		return;
 	case 1:		// mt_arpeggio3
 		x = m->channels[n].params >> 4;
@@ -658,7 +1257,7 @@ static void mt_arpeggio( struct module *m, int n ) {
 		if (p >= pt[i]) { break; }
 	}
   
-	m->channels[n].finalPeriod = mt_periodTable[(int)m->channels[n].finetune][x+i];	//pt[x+i];
+	m->voices[n].finalPeriod = mt_periodTable[(int)m->channels[n].finetune][x+i];	//pt[x+i];
 }
 static void mt_portaUp( struct module *m, int n, int fine ) {
 	m->channels[n].period -= (m->channels[n].params & fine);
@@ -667,7 +1266,7 @@ static void mt_portaUp( struct module *m, int n, int fine ) {
 		m->channels[n].period =  113;
 	}
 	if (fine == 0xff) {
-		m->channels[n].finalPeriod = m->channels[n].period;
+		m->voices[n].finalPeriod = m->channels[n].period;
 	}
 }
 static void mt_portaDown( struct module *m, int n, int fine ) {
@@ -677,9 +1276,15 @@ static void mt_portaDown( struct module *m, int n, int fine ) {
 		m->channels[n].period =  856;
 	}
 	if (fine == 0xff) {
-		m->channels[n].finalPeriod = m->channels[n].period;
+		m->voices[n].finalPeriod = m->channels[n].period;
 	}
 }
+static void mt_tickPortaUp( struct module *m, int n ) {
+	mt_portaUp( m, n, 0xff );
+}
+static void mt_tickPortaDown( struct module *m, int n ) {
+	mt_portaDown( m, n, 0xff );
+}
 static void mt_setTonePorta( struct module *m, int n ) {
 	int i, f;
 	short *pt, note;
@@ -747,7 +1352,7 @@ static void mt_vibrato2( struct module *m, int n ) {
 	// mt_vib_set
 	y = (y * m->channels[n].vibratoDepth) >> 7;
   
-	m->channels[n].finalPeriod = m->channels[n].period + y;
+	m->voices[n].finalPeriod = m->channels[n].period + y;
 	m->channels[n].vibratopos += m->channels[n].vibratoSpeed;
 	m->channels[n].vibratopos &= 0x3f;
 }
@@ -801,7 +1406,7 @@ static void mt_tremolo( struct module *m, int n ) {
   		v = 64;
   	}
 
-  	m->channels[n].finalVolume = v;
+  	m->voices[n].finalVolume = v;
 	m->channels[n].tremolopos += m->channels[n].tremoloSpeed;
 	m->channels[n].tremolopos &= 0x3f;
 }
@@ -816,7 +1421,7 @@ static void mt_volumeSlide( struct module *m, int n ) {
 		}
 	}
   
-	m->channels[n].finalVolume = m->channels[n].volume;
+	m->voices[n].finalVolume = m->channels[n].volume;
 }
 static void mt_filterOnOff( struct module *m, int n ) {
 	m->filterOnOFF = m->channels[n].params & 0x01 ? 1 : 0;
@@ -867,13 +1472,17 @@ static void mt_retrigNote( struct module *m, int n ) {
 		if ((c % p) == 0) {
 			int sample = m->channels[n].sample;
 			m->channels[n].finetune  = m->instruments[sample-1].finetune;
-			m->channels[n].start     = m->instruments[sample-1].sampleStart;
+			m->voices[n].start     = m->instruments[sample-1].sampleStart;
 
-			m->channels[n].loopstart = m->instruments[sample-1].loopStart;
+			m->voices[n].loopstart = m->instruments[sample-1].loopStart;
 			m->channels[n].wavestart = m->instruments[sample-1].loopStart;
-			m->channels[n].length    = m->instruments[sample-1].length;
-			m->channels[n].looped    = m->instruments[sample-1].looped;
-			m->channels[n].pos       = m->instruments[sample-1].loopStart << PRECISION;
+			m->voices[n].length    = m->instruments[sample-1].length;
+			m->voices[n].looped    = m->instruments[sample-1].looped;
+			m->voices[n].pos       = m->instruments[sample-1].loopStart << PRECISION;
+
+			if (m->voices[n].start == 0) {
+				m->playing &= ~(1 << n);
+			}
 		}
 	}
 }
@@ -888,14 +1497,14 @@ static void mt_volumeFineDown( struct module *m, int n ) {
 	}
 }
 static void mt_noteCut( struct module *m, int n ) {
-	m->channels[n].finalVolume = 0;
+	m->voices[n].finalVolume = 0;
 	m->channels[n].volume = 0;
 }
 static void mt_patternDelay( struct module *m, int n ) {
 	if (m->pattDelTime2) { return; }
 	m->pattDelTime = (m->channels[n].params & 0x0f) + 1;
 }
-int strncmp_( char *a, char *b, int len ) {
+int strncmp_( const char *a, const char *b, int len ) {
 	int aa = 0, bb = 0, s = 0;
 	while (s++ < len) {
 		aa = *a++; bb = *b++;
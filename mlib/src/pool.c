@@ -0,0 +1,347 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  pool.c
+//
+// Description:
+//  This module implements the shared sample pool. Every sample added to
+//  the pool gets hashed (FNV-1a) and compared against the samples already
+//  in the pool. A match only increments the reference count, otherwise
+//  the sample gets copied into the first free area that fits. A sample
+//  is freed when its last reference gets removed.
+//
+//  mt_poolSamples() moves all samples of a module into the pool and
+//  points the instruments there. The mixer plays the pooled samples
+//  exactly like the ones in the module image, so pooling costs nothing
+//  at playback. Since the samples are at the end of a module file, the
+//  module image can be cut down to mt_headerSize() bytes afterwards.
+//
+//  mt_unrollLoops() copies the instruments with short loops and repeats
+//  the loop until it is at least minLen bytes. Chip style loops of a few
+//  bytes otherwise make the mixer wrap every few output samples. The
+//  loop start bytes get repeated after the loop, so interpolation reads
+//  the right sample at the loop end.
+//
+//  mt_buildMipmaps() builds half and quarter rate copies of the
+//  instruments, low-pass filtered with (1 2 1)/4 before dropping every
+//  other sample. The mixer plays a copy when the step is at least 2 or
+//  4 and scales the position, length and loop start for it. A looped
+//  instrument gets a level only if its loop start and length divide by
+//  the rate, so the loops stay exactly as long. The memory size caps
+//  the copies, instruments that do not fit anymore play at full rate.
+//
+//  This module does not depend on the libc or any other host system
+//  dependant function.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include "player.h"
+#include "pool.h"
+
+//
+
+static unsigned long mt_poolHash( const signed char *s, int len ) {
+	unsigned long h = 2166136261UL;
+	int n;
+
+	for (n = 0; n < len; n++) {
+		h = ((h ^ (unsigned char)s[n]) * 16777619UL) & 0xffffffffUL;
+	}
+	return h;
+}
+
+static int mt_poolLen( int len ) {
+	return (len + POOL_GUARD + 3) & ~3;
+}
+
+//
+// Finds a free area of len bytes. Tries the beginning of the pool and
+// the end of every pooled sample. Returns -1 if nothing was found.
+//
+
+static int mt_poolAlloc( struct samplePool *p, int len ) {
+	int n, i, b;
+
+	for (n = -1; n < p->numEntries; n++) {
+		b = n < 0 ? 0 : p->entries[n].base + mt_poolLen( p->entries[n].len );
+
+		if (b + len > p->size) { continue; }
+
+		for (i = 0; i < p->numEntries; i++) {
+			if (b < p->entries[i].base + mt_poolLen( p->entries[i].len ) &&
+			    p->entries[i].base < b + len) {
+				break;
+			}
+		}
+		if (i == p->numEntries) {
+			return b;
+		}
+	}
+	return -1;
+}
+
+static int mt_poolFind( struct samplePool *p, const signed char *smp ) {
+	int n;
+
+	for (n = 0; n < p->numEntries; n++) {
+		if (p->mem + p->entries[n].base == smp) { return n; }
+	}
+	return -1;
+}
+
+//
+
+int mt_initPool( struct samplePool *p, void *mem, int size ) {
+	int n;
+
+	for (n = 0; n < sizeof(struct samplePool); n++) {
+		((char *)p)[n] = 0;
+	}
+	if (mem == (void *)0) {
+		return -1;
+	}
+	p->mem  = (signed char *)mem;
+	p->size = size & ~3;
+	return 0;
+}
+
+//
+// Adds a sample to the pool and returns a pointer to the pooled copy or
+// NULL if there is no room. The caller's copy is not needed afterwards.
+//
+
+const signed char *mt_poolAdd( struct samplePool *p, const signed char *smp, int len ) {
+	unsigned long h = mt_poolHash( smp, len );
+	struct _poolEntries *e;
+	int n, i, b;
+
+	for (n = 0; n < p->numEntries; n++) {
+		e = &p->entries[n];
+
+		if (e->hash != h || e->len != len) { continue; }
+
+		for (i = 0; i < len; i++) {
+			if (p->mem[e->base + i] != smp[i]) { break; }
+		}
+		if (i == len) {
+			e->refs++;
+			p->shared++;
+			p->saved += len;
+			return p->mem + e->base;
+		}
+	}
+	if (p->numEntries == POOL_ENTRIES) { return (const signed char *)0; }
+	if ((b = mt_poolAlloc( p, mt_poolLen( len ) )) < 0) { return (const signed char *)0; }
+
+	for (i = 0; i < len; i++) {
+		p->mem[b + i] = smp[i];
+	}
+	for (; i < mt_poolLen( len ); i++) {
+		p->mem[b + i] = 0;
+	}
+	e = &p->entries[p->numEntries++];
+	e->hash = h;
+	e->len  = len;
+	e->base = b;
+	e->refs = 1;
+	p->used += mt_poolLen( len );
+	return p->mem + b;
+}
+
+//
+// Removes one reference to a pooled sample.
+//
+
+void mt_poolRemove( struct samplePool *p, const signed char *smp ) {
+	int n;
+
+	if ((n = mt_poolFind( p, smp )) < 0) { return; }
+
+	if (--p->entries[n].refs > 0) {
+		p->saved -= p->entries[n].len;
+		p->shared--;
+		return;
+	}
+	p->used -= mt_poolLen( p->entries[n].len );
+	p->entries[n] = p->entries[--p->numEntries];
+}
+
+//
+// Moves the samples of a module into the pool. Voices playing from the
+// module image get moved along, so this can be done while playing.
+// Returns -1 if the pool ran out of room; the samples that did not fit
+// keep playing from the module image. Not for lazily loaded modules.
+//
+
+int mt_poolSamples( struct module *m, struct samplePool *p ) {
+	const signed char *s, *d;
+	int n, ch, len, ret = 0;
+
+	if (m->cache || m->pool || m->unrolledBytes) { return -1; }
+
+	for (n = 0; n < m->numInstruments; n++) {
+		s   = m->instruments[n].sampleStart;
+		len = m->instruments[n].sampleLen;
+
+		if (s == 0 || len == 0) { continue; }
+
+		if ((d = mt_poolAdd( p, s, len )) == 0) {
+			ret = -1;
+			continue;
+		}
+		m->sbuf->enterCriticalSection( m->sbuf );
+
+		for (ch = 0; ch < MAX_SUPPORTED_CHANNELS; ch++) {
+			if (m->voices[ch].start >= s && m->voices[ch].start < s + len) {
+				m->voices[ch].start = d + (m->voices[ch].start - s);
+			}
+		}
+		m->instruments[n].sampleStart = d;
+		m->instruments[n].dirtyTail = 0;	// the copy ends where it ends
+		m->sbuf->leaveCriticalSection( m->sbuf );
+	}
+	m->pool = p;
+	return ret;
+}
+
+//
+// Drops the module's references to the pool. Call after mt_end().
+//
+
+void mt_poolRelease( struct module *m ) {
+	int n;
+
+	if (m->pool == 0) { return; }
+
+	for (n = 0; n < m->numInstruments; n++) {
+		if (m->instruments[n].sampleStart && m->instruments[n].sampleLen) {
+			mt_poolRemove( m->pool, m->instruments[n].sampleStart );
+			m->instruments[n].sampleStart = 0;
+		}
+	}
+	m->pool = 0;
+}
+
+//
+// Unrolls the loops shorter than minLen bytes into mem. With a NULL mem
+// returns the bytes needed for all of them. Otherwise unrolls as many
+// as fit into size bytes and returns the bytes used (also kept in
+// m->unrolledBytes) or -1 for lazily loaded or pooled modules.
+//
+
+int mt_unrollLoops( struct module *m, void *mem, int size, int minLen ) {
+	signed char *d = (signed char *)mem;
+	const signed char *s;
+	int n, i, j, l, k, c, len, used = 0;
+
+	if (m->cache || m->pool || m->unrolledBytes || m->mipBytes) { return -1; }
+
+	for (n = 0; n < m->numInstruments; n++) {
+		s = m->instruments[n].sampleStart;
+		l = m->instruments[n].length - m->instruments[n].loopStart;
+
+		if (s == 0 || !m->instruments[n].looped || l <= 0 || l >= minLen) {
+			continue;
+		}
+		k   = (minLen + l - 1) / l;
+		len = (m->instruments[n].loopStart + k * l + UNROLL_GUARD + 3) & ~3;
+
+		if (mem) {
+			if (used + len > size) { continue; }
+
+			// every pass of a loop from the start plays it cleared
+
+			for (i = 0; i < len; i++) {
+				j = i - m->instruments[n].loopStart;
+				c = j < 0 ? i : m->instruments[n].loopStart + j % l;
+				d[used + i] = c < SAMPLEHEAD && m->instruments[n].dirtyHead ? 0 : s[c];
+			}
+			m->sbuf->enterCriticalSection( m->sbuf );
+			m->instruments[n].sampleStart = d + used;
+			m->instruments[n].length = m->instruments[n].loopStart + k * l;
+			m->instruments[n].dirtyTail = 0;
+			m->sbuf->leaveCriticalSection( m->sbuf );
+		}
+		used += len;
+	}
+	if (mem) {
+		m->unrolledBytes = used;
+	}
+	return used;
+}
+
+//
+// Builds one level of len bytes from the level above, which has src
+// bytes. The first head bytes of the level above are read cleared, like
+// the mixer plays them. The guard bytes repeat the loop start like
+// mt_unrollLoops().
+//
+
+#define MIPSRC(i)	((i) < head ? 0 : s[i])
+
+static void mt_decimate( signed char *d, const signed char *s, int src, int len,
+                         int head, int loopStart, int looped ) {
+	int n, a, c;
+
+	for (n = 0; n < len; n++) {
+		a = n > 0 ? MIPSRC(2 * n - 1) : MIPSRC(0);
+		c = 2 * n + 1 < src ? MIPSRC(2 * n + 1) : MIPSRC(2 * n);
+		d[n] = (a + 2 * MIPSRC(2 * n) + c + 2) >> 2;
+	}
+	for (n = 0; n < UNROLL_GUARD; n++) {
+		d[len + n] = looped && loopStart + n < len ? d[loopStart + n] : 0;
+	}
+}
+
+//
+// Returns the bytes used or needed with a NULL memory, or -1 if the
+// instruments can not be changed anymore.
+//
+
+int mt_buildMipmaps( struct module *m, void *mem, int size ) {
+	signed char *d = (signed char *)mem;
+	const signed char *mip[MIP_LEVELS];
+	const signed char *s;
+	struct _instruments *ins;
+	int n, l, len, src, used = 0;
+
+	if (m->cache || m->mipBytes) { return -1; }
+
+	for (n = 0; n < m->numInstruments; n++) {
+		ins = &m->instruments[n];
+		s   = ins->sampleStart;
+		src = ins->length;
+
+		mip[0] = mip[1] = (const signed char *)0;
+
+		// a level is built from the one above
+
+		for (l = 0; l < MIP_LEVELS && s; l++) {
+			len = ins->length >> (l + 1);
+
+			if (len < 2) { break; }
+			if (ins->looped && ((ins->loopStart | ins->length) & ((2 << l) - 1))) {
+				break;
+			}
+			if (mem) {
+				if (used + len + UNROLL_GUARD > size) { break; }
+
+				mt_decimate( d + used, s, src, len, ins->dirtyHead ? SAMPLEHEAD >> l : 0,
+				             ins->loopStart >> (l + 1), ins->looped );
+				s = mip[l] = d + used;
+			}
+			src = len;
+			used += (len + UNROLL_GUARD + 3) & ~3;
+		}
+		if (mem) {
+			m->sbuf->enterCriticalSection( m->sbuf );
+			ins->mip[0] = mip[0];
+			ins->mip[1] = mip[1];
+			m->sbuf->leaveCriticalSection( m->sbuf );
+		}
+	}
+	if (mem) {
+		m->mipBytes = used;
+	}
+	return used;
+}
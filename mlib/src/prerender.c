@@ -0,0 +1,289 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+// Module:
+//  prerender.c
+//
+// Description:
+//  This module implements the music pre-render ring. mt_initPreRender()
+//  moves the module channels into a second module struct, which from
+//  then on only gets played by mt_servicePreRender(). Every serviced tick
+//  runs the player and mixes the module channels into the ring, along
+//  with the buffer length, the song position and the LED filter state of
+//  the tick. mt_music() takes one rendered tick per call, mixes the FX
+//  channels on top and converts as usual. The music bus gain and ducking
+//  get applied when the rendered music is taken, so they still act
+//  immediately.
+//
+//  The ring is lock-free with one writer (mt_servicePreRender()) and one
+//  reader (the mixing context). If no rendered tick is ready the music
+//  is silent for the buffer and underruns gets incremented, the mixing
+//  context never waits and never runs the player itself. The music then
+//  continues where it stopped, late by the silent buffers.
+//
+//  The player events of the music module get forwarded into the event
+//  ring of mod when their tick is played, so the event times stay right.
+//  They wait in the event ring of the music module until then, so with
+//  events enabled the rendering stays only as far ahead as that ring can
+//  hold the events of.
+//  The channel state snapshots only show the song position and the FX
+//  channels. Module switching is not possible while pre-rendering.
+//
+//  Select the output format, mt_halfRate() etc before mt_initPreRender(),
+//  the music module uses a copy of the sound buffer parameters.
+//
+//  This module does not depend on the libc or any other host system
+//  dependant function.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#include "player.h"
+#include "mixer.h"
+#include "prerender.h"
+
+//
+// The GP32 has a single ARM920T core, so only the compiler needs to be
+// kept from reordering the ring and the index stores.
+//
+
+#ifdef __arm__
+#define BARRIER()	__asm__ __volatile__ ("" ::: "memory")
+#else
+#define BARRIER()	__sync_synchronize()
+#endif
+
+static void mt_copyBytes( void *dst, const void *src, int len ) {
+	char *d = (char *)dst;
+	const char *s = (const char *)src;
+
+	while (len-- > 0) {
+		*d++ = *s++;
+	}
+}
+
+//
+// Moves the module channels of mod into music and starts pre-rendering
+// them into mem. The size of mem should hold at least a few ticks at bpm
+// 32, mt_servicePreRender() fills all of it. Returns -1 if the module is
+// switching, lazily loaded or pre-rendering already.
+//
+
+int mt_initPreRender( struct module *m, struct module *music, struct musicRing *r,
+                      void *mem, int size ) {
+	struct soundBufParams *sb = m->sbuf;
+	int ch;
+
+	if (m->ring || m->cache || mt_switching( m ) || music == m) { return -1; }
+
+	r->mem = (int *)mem;
+	r->size = size / sizeof(int);
+	r->head = 0;
+	r->maxLen = calcBufferSize( sb, 1, 32 ) / sb->stereo >> m->halfRate;
+	r->music = music;
+	r->tickHead = 0;
+	r->tickTail = 0;
+	r->cur = (const int *)0;
+	r->skew = 0;
+	r->skewed = 0;
+	r->underruns = 0;
+
+	if (r->size < r->maxLen * 2) { return -1; }
+
+	sb->enterCriticalSection( sb );
+	mt_copyBytes( &r->sbuf, sb, sizeof(struct soundBufParams) );
+	mt_copyBytes( music, m, sizeof(struct module) );
+
+	// the music module plays the module channels only..
+
+	music->sbuf = &r->sbuf;
+	music->playing &= ~MOD_MASK;
+	music->userCallback = 0;
+	music->stateEnable = 0;
+	music->evHead = 0;
+	music->evTail = 0;
+	music->musicGain = UNITYGAIN;
+	music->busGain[BUS_MUSIC] = UNITYGAIN;
+	music->duck = UNITYGAIN;
+	music->duckStep = 0;
+
+	// ..and mod the FX channels
+
+	m->playing &= MOD_MASK;
+
+	for (ch = 0; ch < MAX_MOD_CHANNELS; ch++) {
+		m->channels[ch].period = 0;
+	}
+	m->ring = r;
+	sb->leaveCriticalSection( sb );
+	return 0;
+}
+
+//
+// Finds room for a tick of len samples after the last rendered tick.
+//
+
+static int mt_ringRoom( struct musicRing *r, int len ) {
+	int tail = r->tickTail;
+	int t;
+
+	if (tail == r->tickHead) {
+		return len <= r->size ? 0 : -1;		// all free
+	}
+	t = r->ticks[tail].pos;
+
+	if (r->head == t) {
+		return -1;				// all used, the oldest tick ends at head
+	}
+	if (r->head > t) {
+		if (r->head + len <= r->size) { return r->head; }
+		return len <= t ? 0 : -1;
+	}
+	return r->head + len <= t ? r->head : -1;
+}
+
+//
+// Returns non-zero if the event ring of the music module has room for
+// the most events a tick can post with mask. The events only get taken
+// when their tick is heard, so rendering further ahead would lose them.
+//
+
+static int mt_eventRoom( struct module *mu, int mask ) {
+	int need = 0;
+
+	if (mask & (1 << EV_ROW))  { need += 1; }
+	if (mask & (1 << EV_NOTE)) { need += 2 * mu->numCh; }	// a note and a delayed one
+	if (mask & (1 << EV_SYNC)) { need += mu->numCh; }
+
+	return ((mu->evTail - mu->evHead - 1) & (MT_EVENTS - 1)) >= need;
+}
+
+//
+// Renders ticks until the ring is full, or with events enabled until
+// the event ring of the music module could not take another tick. Call
+// from the main loop or a worker thread, never from the mixing context.
+// Returns the number of ticks rendered.
+//
+
+int mt_servicePreRender( struct module *m ) {
+	struct musicRing *r = m->ring;
+	struct module *mu;
+	struct _renderedTicks *e;
+	unsigned long skew;
+	int pos, len, mask, n = 0;
+
+	if (r == 0) { return 0; }
+
+	mu = r->music;
+
+	while (((r->tickHead + 1) & (RENDER_TICKS - 1)) != r->tickTail) {
+		if ((pos = mt_ringRoom( r, r->maxLen )) < 0) {
+			break;
+		}
+		mask = m->evMask & ~(1 << EV_FXDONE);
+
+		if (!mt_eventRoom( mu, mask )) {
+			break;
+		}
+
+		// keep the event times in step with the output
+
+		skew = r->skew;
+		mu->frames += skew - r->skewed;
+		r->skewed = skew;
+
+		mu->enable = m->enable;
+		mu->evMask = mask;
+		mt_tick( mu );
+
+		len = mu->sbuf->len / mu->sbuf->stereo >> mu->halfRate;
+		mixMusic( mu, r->mem + pos, len );
+
+		e = &r->ticks[r->tickHead];
+		e->pos = pos;
+		e->len = len;
+		e->outLen = mu->sbuf->len;
+		e->bpm = mu->sbuf->bpm;
+		e->songPos = mu->songPos;
+		e->patternPos = mu->patternPos;
+		e->row = mu->row;
+		e->filterOnOFF = mu->filterOnOFF;
+
+		mu->frames += mu->sbuf->len / mu->sbuf->stereo;
+		r->head = pos + len;
+
+		BARRIER();
+		r->tickHead = (r->tickHead + 1) & (RENDER_TICKS - 1);
+		n++;
+	}
+	return n;
+}
+
+//
+// Returns the number of rendered ticks not played yet.
+//
+
+int mt_preRendered( struct module *m ) {
+	struct musicRing *r = m->ring;
+
+	return r ? (r->tickHead - r->tickTail) & (RENDER_TICKS - 1) : 0;
+}
+
+//
+// Takes the next rendered tick for mixer() and forwards its events.
+//
+
+void mt_nextRendered( struct module *m ) {
+	struct musicRing *r = m->ring;
+	struct module *mu = r->music;
+	struct _renderedTicks *e;
+	struct mt_event *ev;
+	unsigned long end;
+	int t;
+
+	if (r->tickTail == r->tickHead) {
+		r->cur = (const int *)0;
+		r->skew += m->sbuf->len / m->sbuf->stereo;
+		r->underruns++;
+		return;
+	}
+	BARRIER();
+
+	e = &r->ticks[r->tickTail];
+	r->cur = r->mem + e->pos;
+
+	m->sbuf->len = e->outLen;
+	m->sbuf->bpm = e->bpm;
+	m->bpm = e->bpm;
+	m->songPos = e->songPos;
+	m->patternPos = e->patternPos;
+	m->row = e->row;
+	m->filterOnOFF = e->filterOnOFF;
+
+	end = m->frames + e->outLen / m->sbuf->stereo;
+
+	while ((t = mu->evTail) != mu->evHead) {
+		ev = &mu->events[t];
+
+		if ((long)(ev->time - end) >= 0) { break; }
+
+		if (m->evMask & (1 << ev->type)) {
+			mt_postEvent( m, ev->type, ev->channel, ev->a, ev->b, ev->period,
+			              (long)(ev->time - m->frames) > 0 ? ev->time - m->frames : 0 );
+		}
+		BARRIER();
+		mu->evTail = (t + 1) & (MT_EVENTS - 1);
+	}
+}
+
+//
+// Gives the mixed tick back to mt_servicePreRender().
+//
+
+void mt_doneRendered( struct module *m ) {
+	struct musicRing *r = m->ring;
+
+	if (r->cur) {
+		r->cur = (const int *)0;
+		BARRIER();
+		r->tickTail = (r->tickTail + 1) & (RENDER_TICKS - 1);
+	}
+}
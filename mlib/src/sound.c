@@ -26,6 +26,7 @@
 //
 //////////////////////////////////////////////////////////////////////////////
 
+#include <stddef.h>
 #include "gp32.h"
 #include "sound.h"
 
@@ -33,9 +34,9 @@
 
 static int abs_(int);
 void myDMA2_ISR(void) __attribute__ ((naked));
-static int initIIS( long pclk, long rate );
+static int initIIS( long pclk, long rate, int size );
 static void disableIIS( void );
-static void PcmPlayRAW( unsigned char *raw, int len, int rep, int irq );
+static void PcmPlayRAW( unsigned char *raw, int len, int size, int rep, int irq );
 static void WrL3Addr(unsigned char data);
 static void WrL3Data(unsigned char data,int flag);
 static long calcRate( long pclk_, long rate_, long *realRate );
@@ -78,8 +79,6 @@ static int fsMode;			// 256 or 384  - GP32 specific
 #define nISR_DMA2       0x13
 
 #define TICKFREQ	50
-#define SSIZE16BITS	2
-#define SSIZE8BITS	1
 #define STEREOSIZE      2
 #define MONOSIZE        1
 
@@ -275,6 +274,7 @@ static int abs_( int x ) {
 // Parameters:
 //  pclk - [in] a long telling the current PCLK seeting.
 //  rate - [in] a long telling the desired Hz for the sample.
+//  size - [in] sample size in bytes (SSIZE8BITS or SSIZE16BITS).
 //
 // Returns:
 //  fs256 if 256fs system fs, fs384 if 384 system fs.
@@ -283,7 +283,7 @@ static int abs_( int x ) {
 //
 ////////////////////////////////////////////////////////////////////
 
-static int initIIS( long pclk, long rate ) {
+static int initIIS( long pclk, long rate, int size ) {
 	IISPSR iispr;
 	IISCON iiscon;
 	IISMOD iismod;
@@ -325,11 +325,7 @@ static int initIIS( long pclk, long rate ) {
 	iismod.reg.TXRXMODE = 2;	// transmit mode
 	iismod.reg.ACTLEVCH = 0;	// low byte = left channel
 	iismod.reg.SIFMT = 0;		// IIS compatible!!!!
-#ifdef S8MIXER					// 8 bits mono..
-	iismod.reg.SDBITS = 0;		// 8 bits
-#else
-	iismod.reg.SDBITS = 1;		// 16 bits
-#endif
+	iismod.reg.SDBITS = size == SSIZE8BITS ? 0 : 1;	// 8 or 16 bits
 	iismod.reg.MCLKFS = sysfs;	// sys fs
 	iismod.reg.SBCLKFS = 1;		// 32fs serial bit clock speed
   
@@ -362,7 +358,8 @@ static void disableIIS( void ) {
 //
 // Parameters:
 //  raw - [in] a ptr to a raw 16bits PCM sample.
-//  len - [in] the length of the sample in half words.
+//  len - [in] the length of the sample in half words (bytes for 8 bits).
+//  size - [in] sample size in bytes (SSIZE8BITS or SSIZE16BITS).
 //  rep - [in] if 1 repeat sample, if 0 play once.
 //  irq - [in] if 1 enable DMA finished IRQ.
 //
@@ -373,7 +370,7 @@ static void disableIIS( void ) {
 //
 ////////////////////////////////////////////////////////////////////
 
-void PcmPlayRAW( unsigned char *raw, int len, int rep, int irq ) {
+void PcmPlayRAW( unsigned char *raw, int len, int size, int rep, int irq ) {
 	rDMASKTRIG2 |=(1<<2)+(0<<1)+0;
 
 	rDIDST2=(1<<30)+       // destination on peripherial bus */
@@ -390,11 +387,7 @@ void PcmPlayRAW( unsigned char *raw, int len, int rep, int irq ) {
 	  (0<<24)+             // dma-req.source=I2SSDO
 	  (1<<23)+             // (H/W request mode)
 	  (rep<<22)+           // auto reload on/off
-#ifdef S8MIXER		       // 8 bits mono..
-	  (0<<20)+             // data size byte
-#else
-	  (1<<20)+             // data size hword
-#endif
+	  ((size == SSIZE8BITS ? 0 : 1)<<20)+	// data size byte or hword
 	  (len);    	       // transfer size (hwords)
 
 	rDMASKTRIG2 = (0<<2)+(1<<1)+0;  // no-stop, DMA2 channel on, no-sw trigger
@@ -419,7 +412,7 @@ void PcmPlayRAW( unsigned char *raw, int len, int rep, int irq ) {
 
 void playnextchunk( struct soundBufParams *sbuf ) {
 	//PcmPlayRAW( sbuf->buf[sbuf->frame],sbuf->len * sbuf->sampleSize, 0, 1 );
-	PcmPlayRAW( sbuf->buf[sbuf->frame],sbuf->len, 0, 1 );
+	PcmPlayRAW( sbuf->buf[sbuf->frame],sbuf->len, sbuf->sampleSize, 0, 1 );
 	sbuf->frame = (sbuf->frame + 1) & 1;
 }
 
@@ -435,6 +428,7 @@ void playnextchunk( struct soundBufParams *sbuf ) {
 //  none.
 //
 // Note:
+//   The struct soundBufParams offsets come from offsetof().
 //   If OUTSIDEIRQMIXING is defined then the actual player code and
 //   mixing is done outside IRQ mode. The CPU is switched to SYSTEM
 //   mode thus other IRQs may take place duirng mixing.
@@ -458,8 +452,8 @@ void myDMA2_ISR(void) {
 		"	orr		r2,r2,r4			\n"  // Switch to previous non IRQ mode
 		"	ldr		r4,[r5]				\n"  // r4 = ptr to struct soundBufParams
 		"	msr		CPSR_fsxc,r2		\n"  // ...
-		"	ldr		r2,[r4,#4]			\n"  // r0 = ptr to struct module
-		"	ldr		r0,[r4]				\n"  // r2 = ptr to player function
+		"	ldr		r2,[r4,%[CB]]		\n"  // r2 = ptr to player function
+		"	ldr		r0,[r4,%[CBD]]		\n"  // r0 = ptr to struct module
 		"	cmp		r2,#0				\n"
 		"	beq		skip				\n"
 		"	mov		lr,pc				\n"
@@ -478,6 +472,9 @@ void myDMA2_ISR(void) {
 		"	msr		spsr_cxsf,r4		\n"
 		"	ldmia	r13!,{r0-r5,r12,pc}^	\n"
 		"	.pool							"
+		:
+		: [CB]"i"(offsetof(struct soundBufParams, callback)),
+		  [CBD]"i"(offsetof(struct soundBufParams, callbackData))
 	);
 #else
 	asm volatile (""
@@ -486,8 +483,8 @@ void myDMA2_ISR(void) {
 		"	ldr		r0,[r4]				\n"
 		"	bl		playnextchunk		\n"
 		"	ldr		r4,[r4]				\n"  // r4 = ptr to struct soundBufParams
-		"	ldr		r2,[r4,#4]			\n"  // r0 = ptr to struct module
-		"	ldr		r0,[r4]				\n"  // r2 = ptr to player function
+		"	ldr		r2,[r4,%[CB]]		\n"  // r2 = ptr to player function
+		"	ldr		r0,[r4,%[CBD]]		\n"  // r0 = ptr to struct module
 		"	cmp		r2,#0				\n"
 		"	sub		r1,r1,#4			\n"
 		"	beq		skip				\n"
@@ -502,6 +499,9 @@ void myDMA2_ISR(void) {
 		"	ldmia	r13!,{r0-r12,lr}	\n"
 		"	subs	pc,lr,#4			\n"
 		"	.pool							"
+		:
+		: [CB]"i"(offsetof(struct soundBufParams, callback)),
+		  [CBD]"i"(offsetof(struct soundBufParams, callbackData))
 	);
 #endif
 }
@@ -534,11 +534,15 @@ int initSoundBuffer( long playFreq, long pclk, struct soundBufParams *p,
 	p->callbackData = cbdata;
 	p->playFreq   = playFreq;
 	p->stereo     = STEREOSIZE;
-#ifdef S8MIXER						// 8 bits mono..
-	p->sampleSize = SSIZE8BITS;		// 8bits sample only supported
+#ifdef S8MIXER						// 8 bits mono by default..
+	p->sampleSize = SSIZE8BITS;		// see mt_outputFormat()
+	p->format     = SFMT_S8;
 #else
-	p->sampleSize = SSIZE16BITS;	// 16bits sample only supported
+	p->sampleSize = SSIZE16BITS;
+	p->format     = SFMT_S16;
 #endif
+	p->gain       = UNITYGAIN;
+	p->formats    = SFMT_BIT(SFMT_S16,2) | SFMT_BIT(SFMT_S8,2);	// what the IIS plays
 	p->tickFreq   = TICKFREQ;		// 50 ticks per second supported
 	p->clockConstant = PALCLOCK;	// Amiga PAL clock constant
 	p->irq        = -1;				// no irq installed
@@ -566,11 +570,13 @@ int initSoundBuffer( long playFreq, long pclk, struct soundBufParams *p,
 	len = calcBufferSize( p, 1, 32 );
 	p->len = calcBufferSize( p, 1, 125 );;
   
-	if ((buffer = allocMem(2 * len * p->sampleSize +
+	// Room for 16 bits so that the sample size can be changed later
+	if ((buffer = allocMem(2 * len * SSIZE16BITS +
 		sizeof(int) * len))) {
 		p->buf[0] = buffer;
-		p->buf[1] = buffer + len * p->sampleSize;
-		p->tmp    = (int *)(buffer + 2 * len * p->sampleSize);
+		p->buf[1] = buffer + len * SSIZE16BITS;
+		p->tmp    = (int *)(buffer + 2 * len * SSIZE16BITS);
+		p->bufBytes = len * SSIZE16BITS;
 	} else {
 		return -1;
 	}
@@ -613,7 +619,7 @@ static void startSound( struct soundBufParams *p ) {
 	// Setup IIS etc..
 
 	rDMASKTRIG2=(1<<2)+(0<<1)+0;
-	n = initIIS( p->pclk, p->realFreq );
+	n = initIIS( p->pclk, p->realFreq, p->sampleSize );
 	initSoundModule(n,iisbus,0);
 	p->calcFreq = p->clockConstant / p->realFreq;
   
@@ -624,6 +630,7 @@ static void startSound( struct soundBufParams *p ) {
 	}
 	// and trigger DMA..
   
+	p->playing = 1;
 	playnextchunk( p );
 }
 
@@ -635,10 +642,22 @@ static void stopSound( struct soundBufParams *p ) {
 	
 	p->removeIRQ( p->irq );
 	p->irq = -1;
+	p->playing = 0;
 	g_sbuf = (void *)0;
 }
 
+//
+// Keeps the player & mixer out by masking the DMA2 IRQ. Both run on top
+// of the interrupted code, so that is enough even with OUTSIDEIRQMIXING.
+//
+
 static void enterCriticalSection( struct soundBufParams *p ) {
+	if (p->irq >= 0) {
+		rINTMSK |= 1 << p->irq;
+	}
 }
 static void leaveCriticalSection( struct soundBufParams *p ) {
+	if (p->irq >= 0) {
+		rINTMSK &= ~(1 << p->irq);
+	}
 }